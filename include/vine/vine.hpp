@@ -1,7 +1,17 @@
 #pragma once
 
 #include <any>
+#include <new>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <tuple>
 #include <vector>
+#include <utility>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 #include <initializer_list>
 
 #define DELETE_MOVE_COPY(class_name)                    \
@@ -14,7 +24,30 @@
 //=================
 // Compile Flags
 
-// VINE_MAX_THREADS - max number of thread workers
+// VINE_NO_MAIN          - vine does not define main(); program creates vine::runtime or calls vine::run() itself
+// VINE_MAX_THREADS      - max number of thread workers, 1024 by default
+// VINE_ELASTIC_THREADS  - amount of additional workers spawned in place of workers blocked in blocking_region
+// VINE_ELASTIC_IDLE_MS  - how long additional worker stays idle before it exits
+// VINE_SPIN_ITERATIONS  - how many times idle worker spins looking for work before yielding
+// VINE_YIELD_ITERATIONS - how many times idle worker yields looking for work before parking
+// VINE_MAIN_THREAD_WORKER - main thread executes functions while machine runs, taking thread id 0
+// VINE_TASK_WORKERS     - amount of workers dedicated to tasks; other workers then execute only functions
+// VINE_TASK_FAIR_SHARE  - if no workers are dedicated to tasks, worker executes a task after every N functions
+// VINE_TASK_QUEUE_CAPACITY - capacity of lock free tasks queue, power of two
+// VINE_TASK_INLINE_SIZE - bytes of task payload stored inline in pooled task state
+// VINE_TASK_STATES_CACHE - amount of free task states cached by each thread
+// VINE_AFFINITY         - default worker pinning: none, compact, scatter or cpu list; VINE_AFFINITY environment variable overrides it
+// VINE_CACHE_LINE_SIZE  - alignment used to keep data written by diffrent threads on separate cache lines
+// VINE_FRAME_ARENA_BLOCK_SIZE - size of the first memory block of each thread frame arena
+// VINE_PROFILER         - records execution of machines, stages, functions and tasks; dumped as chrome trace at shutdown
+// VINE_PROFILER_CAPACITY - amount of the newest events kept by each thread
+// VINE_PROFILER_OUTPUT  - path of trace written at shutdown
+// VINE_STATS            - records rolling duration statistics of links; dumped with critical paths at shutdown
+// VINE_STATS_WINDOW     - amount of the newest durations statistics are computed from
+// VINE_STATS_OUTPUT     - path of statistics written at shutdown
+// VINE_PRIORITY_REFRESH - with VINE_STATS, machine executions between recomputing scheduling priorities from measured durations
+//                         pipelined machine stops overlapping it's runs for the recomputation
+// VINE_TICK_SPIN_US     - how long before tick of fixed rate machine the main thread stops sleeping and spins
 
 //=================
 // State
@@ -31,17 +64,53 @@ namespace vine {
     // sets machine to be executed after the current finishes
     void set_machine(const machine&);
 
-    // request program shutdown
+    // request program shutdown; in library mode it returns from runtime::run
     void request_shutdown();
+
+    // owns worker threads; vine's main() creates one, with VINE_NO_MAIN the program does
+    // only one runtime may exist at a time, and it is used from the thread which created it
+    // destroying it waits for issued tasks and stops workers, so it can be created again, e.g. per benchmark or test
+    struct runtime {
+        runtime();
+        ~runtime();
+
+        // executes queued machines until shutdown is requested
+        void run();
+        void run(const machine& machine);
+
+        // executes single run of the machine and returns once it completes
+        void run_once(const machine& machine);
+
+        DELETE_MOVE_COPY(runtime)
+    };
+
+    // creates runtime and executes default machine until shutdown; body of vine's main()
+    void run();
 }
 
 //=================
 // Threads
 
 namespace vine {
-    // returns amount of thread workers
+    // returns max amount of thread workers, including VINE_ELASTIC_THREADS spawned on demand
+    // amount of workers alive whole program is resolved once, on the first call, from VINE_THREADS environment variable,
+    // or from cpus available to the process, respecting affinity mask and cgroup cpu quota
     unsigned int get_threads_amount();
 
+    // overrides amount of workers alive whole program; fails once the amount was resolved
+    // batches query it while constructed, so call it before any of them, e.g. from initializer of global variable
+    bool set_threads_amount(unsigned int amount);
+
+    // declare variable of this type around code blocking the worker, like waiting on io or lock
+    // while the worker is inside, additional worker may be spawned, so cores do not idle
+    struct blocking_region {
+        blocking_region();
+        ~blocking_region();
+        DELETE_MOVE_COPY(blocking_region)
+    private:
+        bool active;
+    };
+
     // returns id of current thread
     // the id is in range (0 <= x < get_threads_amount())
     unsigned int get_thread_id();
@@ -51,7 +120,8 @@ namespace vine {
 // Stage
 
 namespace vine {
-    using func = void(*)();
+    using func       = void(*)();
+    using range_func = void(*)(size_t begin, size_t end);
 
     // declare variable of this type in global scope to create a new stage
     struct stage {
@@ -68,6 +138,21 @@ namespace vine {
             const std::initializer_list<const func_stage_link*>& depedencies
         );
         DELETE_MOVE_COPY(func_stage_link)
+    protected:
+        func_stage_link(){};
+    };
+
+    // declare variable of this type in global scope to link data parallel loop over [0, range) to the target stage
+    // body is called with chunks of up to grain indices, which idle workers take dynamically
+    // dependants of the link are executed once all chunks complete; it can be used as depedency of other links
+    struct parallel_for_stage_link : func_stage_link {
+        parallel_for_stage_link(
+            size_t range,
+            size_t grain,
+            range_func body,
+            const stage& target, 
+            const std::initializer_list<const func_stage_link*>& depedencies
+        );
     };
 };
 
@@ -91,19 +176,142 @@ namespace vine {
         );
         DELETE_MOVE_COPY(stage_machine_link);
     };
+
+    // declare variable of this type in global scope to let the next run of the target machine overlap the current one
+    // stage of the next run is released once it's depedencies in that run complete, the same stage of the current run
+    // completes, and listed stages of the current run it depends on complete; the rest of the current run may still execute
+    // at most two runs are in flight; runs of diffrent machines never overlap
+    struct pipeline_machine_link {
+        struct previous_run_depedency {
+            const stage_machine_link* stage;
+            const stage_machine_link* depedency;  //stage of the previous run which stage waits for
+        };
+
+        pipeline_machine_link(
+            const machine& target,
+            const std::initializer_list<previous_run_depedency>& depedencies
+        );
+        DELETE_MOVE_COPY(pipeline_machine_link);
+    };
+
+    // called on main thread after run of fixed rate machine overran it's period
+    using deadline_miss_handler = void(*)(const machine& machine, uint64_t overrun_ns);
+
+    // declare variable of this type in global scope to execute the target machine at fixed rate
+    // the next run starts one period after the previous one was scheduled; main thread sleeps, then spins the rest of the wait
+    // overrunning runs are reported to on_miss, and the schedule restarts from their end instead of catching up
+    // rate_hz must be positive, finite and give a period of at least one clock tick, program aborts otherwise
+    struct tick_machine_link {
+        tick_machine_link(
+            const machine& target,
+            double rate_hz,
+            deadline_miss_handler on_miss = nullptr
+        );
+        DELETE_MOVE_COPY(tick_machine_link);
+    };
+}
+
+//=================
+// Profiling
+
+namespace vine {
+    // names objects in profiler traces; unnamed ones are shown with their ids
+    void set_debug_name(const stage& stage, const char* name);
+    void set_debug_name(const machine& machine, const char* name);
+    void set_debug_name(const func_stage_link& link, const char* name);
+    void set_debug_name(const stage_machine_link& link, const char* name);
+
+    // writes recorded events as chrome trace json, viewable in chrome://tracing or ui.perfetto.dev
+    // requires VINE_PROFILER, returns false otherwise; call it when workers are idle
+    bool dump_profile(const char* path);
+}
+
+//=================
+// Statistics
+
+namespace vine {
+    // durations of the newest executions, in nanoseconds
+    // function links are timed while executing, stage links from their release to completion of their last function
+    struct link_stats {
+        double   mean    = 0;
+        uint64_t p50     = 0;
+        uint64_t p99     = 0;
+        size_t   samples = 0;
+    };
+
+    // requires VINE_STATS, returns empty stats otherwise
+    link_stats get_link_stats(const func_stage_link& link);
+    link_stats get_link_stats(const stage_machine_link& link);
+
+    // the longest chain of functions through machine, which bounds it's execution time
+    // weighted by mean durations; functions without samples weigh 1, so without VINE_STATS it is the longest chain
+    struct critical_path {
+        double                                 length = 0;
+        std::vector<const stage_machine_link*> stages;  //in order of execution
+        std::vector<const func_stage_link*>    funcs;   //in order of execution
+    };
+
+    critical_path get_critical_path(const machine& machine);
+
+    // pacing of machine linked with tick_machine_link
+    // frame time is measured from the run start until main thread may start the next one; jitter is delay of the start after it's tick
+    struct tick_stats {
+        uint64_t   ticks           = 0;
+        uint64_t   deadline_misses = 0;
+        link_stats frame_time;
+        link_stats jitter;
+    };
+
+    // recorded regardless of VINE_STATS; returns empty stats for machines without fixed rate
+    tick_stats get_tick_stats(const machine& machine);
+
+    // writes statistics of all links and critical paths of all machines as text
+    bool dump_stats(const char* path);
 }
 
 //=================
 // Batch
 
+#ifndef VINE_CACHE_LINE_SIZE
+    #define VINE_CACHE_LINE_SIZE 64
+#endif
+
 namespace vine {
     // batch creates given container for each vine worker thread
     // you can sync it's information by iterating on it's containers
     template<class container>
     struct batch {
     private:
-        std::vector<container> containers;
+        // each container starts on it's own cache line, so threads do not share them
+        struct alignas(VINE_CACHE_LINE_SIZE) slot {
+            container value;
+        };
+
+        std::vector<slot> containers;
+
+        template<class operation>
+        void reduce_range(size_t begin, size_t end, operation& op);
     public:
+        // iterates batch containers without allocating
+        struct containers_view {
+            struct iterator {
+                slot* current;
+
+                container& operator*()  const { return current->value; }
+                container* operator->() const { return &current->value; }
+                iterator&  operator++()       { ++current; return *this; }
+                bool operator==(const iterator& other) const { return current == other.current; }
+                bool operator!=(const iterator& other) const { return current != other.current; }
+            };
+
+            slot* first;
+            slot* last;
+
+            iterator begin() const { return {first}; }
+            iterator end()   const { return {last}; }
+            size_t   size()  const { return last - first; }
+        };
+
         batch();
 
         // returns container assigned to this thread
@@ -111,15 +319,156 @@ namespace vine {
 
         // returns list of all batch containers
         std::vector<container*> get_all_containers();
+
+        // returns view of all batch containers
+        containers_view         get_containers_view();
+
+        // merges all containers into the first one and returns it; op(target, source) merges source into target
+        // merges run as tasks in a tree of log2(threads) levels; source containers are left as op leaves them
+        template<class operation>
+        container&              reduce(operation op);
+
+        // reduces batch and merges the result into target with op(target, result)
+        template<class operation>
+        void                    combine_into(container& target, operation op);
+    };
+
+    // integer counter accumulated separately by each thread
+    // snapshot can be taken from any thread at any time, without syncing in stage graph
+    struct batch_counter {
+    private:
+        struct alignas(VINE_CACHE_LINE_SIZE) slot {
+            std::atomic<int64_t> value = 0;
+        };
+
+        std::unique_ptr<slot[]> slots;
+        unsigned int            slots_amount;
+    public:
+        batch_counter();
+
+        void    add(int64_t value = 1) { slots[get_thread_id()].value.fetch_add(value, std::memory_order_relaxed); }
+
+        int64_t snapshot() const;  //sum of all threads counters
+        void    reset();           //not atomic with concurrent adds
+    };
+
+    // histogram with power of two buckets accumulated separately by each thread
+    // bucket i holds values of bit width i: 0, 1, [2, 4), [4, 8) ... [2^63, 2^64)
+    struct batch_histogram {
+        static constexpr size_t buckets_amount = 65;
+
+        struct snapshot_data {
+            std::array<uint64_t, buckets_amount> buckets{};
+            uint64_t count = 0;
+            uint64_t sum   = 0;
+
+            double   mean() const;
+            uint64_t percentile(double p) const;  //upper bound of bucket holding p-th percentile, p in [0, 1]
+        };
+    private:
+        struct alignas(VINE_CACHE_LINE_SIZE) slot {
+            std::array<std::atomic<uint64_t>, buckets_amount> buckets{};
+            std::atomic<uint64_t> sum = 0;
+        };
+
+        std::unique_ptr<slot[]> slots;
+        unsigned int            slots_amount;
+
+        static size_t bucket_of(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return value ? 64 - __builtin_clzll(value) : 0;
+#else
+            size_t width = 0;
+            while (value) { value >>= 1; width++; }
+            return width;
+#endif
+        }
+    public:
+        batch_histogram();
+
+        void record(uint64_t value) {
+            auto& s = slots[get_thread_id()];
+            s.buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+            s.sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        snapshot_data snapshot() const;
+        void          reset();            //not atomic with concurrent records
+    };
+}
+
+//=================
+// Frame Arena
+
+namespace vine {
+    // bump allocator owned by single thread
+    // all of it's memory is released at once, after each machine execution
+    // while runs of pipelined machine overlap, each of them allocates from it's own arena
+    struct alignas(VINE_CACHE_LINE_SIZE) frame_arena {
+    private:
+        unsigned char* current = nullptr;
+        unsigned char* end     = nullptr;
+
+        std::vector<std::unique_ptr<unsigned char[]>> blocks;
+        size_t                                        blocks_size = 0;  //total size of blocks
+        uint64_t                                      epoch       = 0;  //machine execution the memory belongs to
+
+        void* allocate_block(size_t size, size_t alignment);
+        friend frame_arena& get_local_frame_arena();
+    public:
+        // returned memory is valid until the end of current machine execution
+        void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+            auto address = ((uintptr_t)current + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            if (current && address + size <= (uintptr_t)end) {
+                current = (unsigned char*)(address + size);
+                return (void*)address;
+            }
+            return allocate_block(size, alignment);
+        }
+
+        // releases all memory; blocks are merged into one, so following executions do not allocate
+        void reset();
+    };
+
+    // returns arena of this thread; reset lazily once machine execution finishes
+    // workers use arena of their id, any other thread gets it's own one, valid until the next machine run starts
+    frame_arena& get_local_frame_arena();
+
+    // stl allocator taking memory from frame arena of allocating thread; deallocation is no-op
+    // containers using it must not outlive machine execution
+    template<class T>
+    struct frame_allocator {
+        using value_type = T;
+
+        frame_allocator() = default;
+        template<class U> frame_allocator(const frame_allocator<U>&) {}
+
+        T*   allocate(size_t n)    { return static_cast<T*>(get_local_frame_arena().allocate(n * sizeof(T), alignof(T))); }
+        void deallocate(T*, size_t) {}
+
+        template<class U> bool operator==(const frame_allocator<U>&) const { return true; }
+        template<class U> bool operator!=(const frame_allocator<U>&) const { return false; }
     };
 }
 
 //=================
 // Tasks
 
+#ifndef VINE_TASK_INLINE_SIZE
+    #define VINE_TASK_INLINE_SIZE 64
+#endif
+
 namespace vine {
     using task = void(*)(std::any);
 
+    template<class result>
+    struct task_future;
+
+    namespace detail {
+        template<class F, class... Args>
+        using task_result_t = std::decay_t<std::invoke_result_t<std::decay_t<F>&, std::decay_t<Args>...>>;
+    }
+
     struct task_promise {
         struct implementation;
         implementation* impl;
@@ -131,11 +480,95 @@ namespace vine {
         task_promise& operator=(const task_promise& other);
     
         bool completed(); //whether task completed execution
-        void join();      //wait task completion                  todo forbid joins on other tasks
+        void join();      //wait task completion; worker threads execute other work meanwhile
+
+        // issues callable which is enqueued by the completing worker once this task completes
+        template<class F>
+        task_future<detail::task_result_t<F>> then(F&& f);
     };
 
     // use to push the task onto the execution queue
+    // task states are pooled, so issuing does not allocate unless arg exceeds std::any small buffer
     task_promise issue_task(task task, std::any arg);
+
+    // task promise carrying typed result of the task
+    template<class result>
+    struct task_future : task_promise {
+        std::optional<result>* result_slot = nullptr;
+
+        result get();     //wait task completion and move it's result out; call it once
+
+        // issues callable receiving moved result of this task, once it completes
+        template<class F>
+        task_future<detail::task_result_t<F, result>> then(F&& f);
+    };
+
+    template<>
+    struct task_future<void> : task_promise {
+        void get() { join(); }
+    };
+
+    // use to push callable with it's arguments onto the execution queue
+    // they are stored in place of pooled task state if they fit in VINE_TASK_INLINE_SIZE, otherwise on the heap
+    template<class F, class... Args>
+    task_future<detail::task_result_t<F, Args...>> issue_task(F&& f, Args&&... args);
+
+    // returns promise completed once all of given promises complete
+    task_promise when_all(std::initializer_list<task_promise> promises);
+    task_promise when_all(const std::vector<task_promise>& promises);
+
+    // returns promise completed once any of given promises completes
+    task_promise when_any(std::initializer_list<task_promise> promises);
+    task_promise when_any(const std::vector<task_promise>& promises);
+
+    namespace detail {
+        // acquires pooled state for the promise and returns storage for task payload
+        void* acquire_task(task_promise& promise);
+
+        // pushes task onto execution queue once all depedencies complete; payload must be already constructed in the storage
+        void  submit_task(
+            const task_promise& promise, 
+            void (*invoke)(void* storage), 
+            void (*destroy)(void* storage),
+            const task_promise* depedencies        = nullptr,
+            size_t              depedencies_amount = 0
+        );
+
+        // returns promise without payload completed once all (or any) of depedencies complete
+        task_promise make_task_barrier(const task_promise* depedencies, size_t depedencies_amount, bool any);
+
+        template<class F, class arguments, class result>
+        struct task_payload {
+            F                     callable;
+            arguments             args;
+            std::optional<result> result_slot = std::nullopt;
+
+            void run() { result_slot.emplace(std::apply(callable, std::move(args))); }
+        };
+
+        template<class F, class arguments>
+        struct task_payload<F, arguments, void> {
+            F         callable;
+            arguments args;
+
+            void run() { std::apply(callable, std::move(args)); }
+        };
+
+        template<class payload>
+        constexpr bool task_payload_inline = 
+            sizeof(payload) <= VINE_TASK_INLINE_SIZE && alignof(payload) <= alignof(std::max_align_t);
+
+        template<class payload>
+        payload* task_payload_of(void* storage) {
+            if constexpr (task_payload_inline<payload>) return static_cast<payload*>(storage);
+            else                                        return *static_cast<payload**>(storage);
+        }
+
+        template<class F, class... Args>
+        task_future<task_result_t<F, Args...>> issue_task_after(
+            const task_promise* depedencies, size_t depedencies_amount, F&& f, Args&&... args
+        );
+    }
 };
 
 #undef DELETE_MOVE_COPY
@@ -151,12 +584,105 @@ vine::batch<container>::batch() {
 
 template<class container>
 container& vine::batch<container>::get_local_container() {
-    return containers[get_thread_id()];
+    return containers[get_thread_id()].value;
 }
 
 template<class container>
 std::vector<container*> vine::batch<container>::get_all_containers() {
     std::vector<container*> res;
-    for (auto& c : containers) res.push_back(&c);
+    for (auto& c : containers) res.push_back(&c.value);
     return res;
 }
+
+template<class container>
+typename vine::batch<container>::containers_view vine::batch<container>::get_containers_view() {
+    return {containers.data(), containers.data() + containers.size()};
+}
+
+template<class container>
+template<class operation>
+void vine::batch<container>::reduce_range(size_t begin, size_t end, operation& op) {
+    if (end - begin < 2) return;
+
+    auto middle = begin + (end - begin) / 2;
+
+    //upper half is reduced by other worker meanwhile
+    auto upper = issue_task([this, middle, end, &op] { reduce_range(middle, end, op); });
+    reduce_range(begin, middle, op);
+    upper.join();
+
+    op(containers[begin].value, containers[middle].value);
+}
+
+template<class container>
+template<class operation>
+container& vine::batch<container>::reduce(operation op) {
+    reduce_range(0, containers.size(), op);
+    return containers[0].value;
+}
+
+template<class container>
+template<class operation>
+void vine::batch<container>::combine_into(container& target, operation op) {
+    reduce_range(0, containers.size(), op);
+    op(target, containers[0].value);
+}
+
+template<class result>
+result vine::task_future<result>::get() {
+    join();
+    return std::move(**result_slot);
+}
+
+template<class F, class... Args>
+vine::task_future<vine::detail::task_result_t<F, Args...>> vine::detail::issue_task_after(
+    const task_promise* depedencies, size_t depedencies_amount, F&& f, Args&&... args
+) {
+    using result    = task_result_t<F, Args...>;
+    using arguments = std::tuple<std::decay_t<Args>...>;
+    using payload   = task_payload<std::decay_t<F>, arguments, result>;
+
+    task_future<result> future;
+    void* storage = acquire_task(future);
+
+    payload* p;
+    if constexpr (task_payload_inline<payload>) 
+        p = new (storage) payload{std::forward<F>(f), arguments{std::forward<Args>(args)...}};
+    else 
+        p = *static_cast<payload**>(storage) = new payload{std::forward<F>(f), arguments{std::forward<Args>(args)...}};
+
+    if constexpr (!std::is_void_v<result>) future.result_slot = &p->result_slot;
+
+    submit_task(
+        future,
+        [](void* storage) { task_payload_of<payload>(storage)->run(); },
+        [](void* storage) {
+            if constexpr (task_payload_inline<payload>) static_cast<payload*>(storage)->~payload();
+            else                                        delete *static_cast<payload**>(storage);
+        },
+        depedencies,
+        depedencies_amount
+    );
+
+    return future;
+}
+
+template<class F, class... Args>
+vine::task_future<vine::detail::task_result_t<F, Args...>> vine::issue_task(F&& f, Args&&... args) {
+    return detail::issue_task_after(nullptr, 0, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F>
+vine::task_future<vine::detail::task_result_t<F>> vine::task_promise::then(F&& f) {
+    return detail::issue_task_after(this, 1, std::forward<F>(f));
+}
+
+template<class result>
+template<class F>
+vine::task_future<vine::detail::task_result_t<F, result>> vine::task_future<result>::then(F&& f) {
+    //continuation keeps this task alive, so it can move it's result
+    return detail::issue_task_after(
+        this, 1,
+        [self = *this, f = std::forward<F>(f)]() mutable { return f(std::move(**self.result_slot)); }
+    );
+}
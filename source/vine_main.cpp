@@ -1,7 +1,11 @@
 #include "vine/vine.hpp"
 
 #include <queue>
+#include <memory>
+#include <algorithm>
 #include <vector>
+#include <string>
+#include <chrono>
 #include <unordered_map>
 
 #include <mutex>
@@ -9,20 +13,138 @@
 #include <thread>
 #include <condition_variable>
 
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 /*
     Threads Amount
 */
 
 #ifndef VINE_MAX_THREADS
-    #define VINE_MAX_THREADS 1e16
+    #define VINE_MAX_THREADS 1024
 #endif
 
+#ifndef VINE_ELASTIC_THREADS
+    #define VINE_ELASTIC_THREADS 0
+#endif
+
+#ifdef __linux__
+    #include <sched.h>
+#endif
+
+namespace {
+    std::mutex                threads_amount_mutex;
+    std::atomic<unsigned int> threads_amount = 0;   //workers alive whole program; resolved once, 0 until then
+}
+
+// reads first two numbers of the file; returns amount of read numbers
+static int read_numbers_file(const char* path, double& first, double& second) {
+    auto file = std::fopen(path, "r");
+    if (!file) return 0;
+
+    //cgroup v2 writes unlimited quota as "max"
+    char word[64] = {};
+    int  read = std::fscanf(file, "%63s %lf", word, &second);
+    std::fclose(file);
+
+    if (read < 1) return 0;
+    first = std::strcmp(word, "max") == 0 ? -1 : std::atof(word);
+    return read;
+}
+
+// cgroup v2 path of this process, empty when it's not in the unified hierarchy
+static std::string get_own_cgroup_path() {
+    auto file = std::fopen("/proc/self/cgroup", "r");
+    if (!file) return {};
+
+    std::string path;
+    char line[4096];
+    while (std::fgets(line, sizeof(line), file)) {
+        if (std::strncmp(line, "0::", 3) != 0) continue;
+
+        path = line + 3;
+        while (!path.empty() && path.back() == '\n') path.pop_back();
+        break;
+    }
+
+    std::fclose(file);
+    return path;
+}
+
+// cpus available for this process, limited by affinity mask and cgroup cpu quota
+static unsigned int get_available_cpus_amount() {
+    unsigned int amount = std::thread::hardware_concurrency();
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) amount = CPU_COUNT(&set);
+
+    //cgroup v2 quota of every level up to the mount root applies, the tightest one wins;
+    //path missing under the mount (cgroup not namespaced) just walks up to the root
+    double limit   = -1;
+    bool   unified = false;
+
+    auto path = get_own_cgroup_path();
+    while (true) {
+        double quota = -1, period = 0;
+        if (read_numbers_file(("/sys/fs/cgroup" + path + "/cpu.max").c_str(), quota, period) == 2) {
+            unified = true;
+            if (quota > 0 && period > 0) limit = limit < 0 ? quota / period : std::min(limit, quota / period);
+        }
+
+        if (path.empty() || path == "/") break;
+        path.erase(path.rfind('/'));
+    }
+
+    if (!unified) {
+        double quota = -1, period = 0, unused;
+        if (read_numbers_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", quota, unused) == 1 && 
+            read_numbers_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", period, unused) == 1 &&
+            quota > 0 && period > 0) limit = quota / period;
+    }
+
+    if (limit > 0) {
+        auto cpus = (unsigned int)std::ceil(limit);
+        amount = std::min(amount, std::max(cpus, 1u));
+    }
+#endif
+
+    return amount;
+}
+
+static unsigned int resolve_threads_amount() {
+    auto env = std::getenv("VINE_THREADS");
+    auto amount = env ? (unsigned int)std::strtoul(env, nullptr, 10) : 0u;
+    if (amount == 0) amount = get_available_cpus_amount();
+
+    return std::max(1u, std::min<unsigned int>(amount, VINE_MAX_THREADS));
+}
+
+static unsigned int get_core_threads_amount() {
+    auto amount = threads_amount.load(std::memory_order_acquire);
+    if (amount) return amount;
+
+    std::lock_guard<std::mutex> lock{threads_amount_mutex};
+    if (!threads_amount.load(std::memory_order_relaxed)) threads_amount.store(resolve_threads_amount(), std::memory_order_release);
+    return threads_amount.load(std::memory_order_relaxed);
+}
+
+//ids of elastic workers follow core ones, so everything indexed by thread id is sized for all of them
 unsigned int vine::get_threads_amount() {
-    size_t hc = std::thread::hardware_concurrency();
-    if (hc > VINE_MAX_THREADS) hc = VINE_MAX_THREADS;
-    return hc;
+    return get_core_threads_amount() + VINE_ELASTIC_THREADS;
+}
+
+bool vine::set_threads_amount(unsigned int amount) {
+    std::lock_guard<std::mutex> lock{threads_amount_mutex};
+    if (threads_amount.load(std::memory_order_relaxed) || amount == 0) return false;
+
+    threads_amount.store(std::min<unsigned int>(amount, VINE_MAX_THREADS), std::memory_order_release);
+    return true;
 }
 
 /*
@@ -33,7 +155,7 @@ namespace {
     std::mutex           state_mutex;
     const vine::machine* current_machine = nullptr;
     const vine::machine* queued_machine  = nullptr;
-    bool                 should_shutdown = false;
+    std::atomic<bool>    should_shutdown = false;  //may be requested by pipelined run while main thread checks it
 }
 
 vine::default_machine_link::default_machine_link(const machine& m) {
@@ -50,11 +172,144 @@ void vine::request_shutdown() {
     should_shutdown = true;
 }
 
+//functions of pipelined run may queue machine while it is applied, so it is read under lock
 static void apply_machine() {
-    if (queued_machine != current_machine) {
-        std::lock_guard<std::mutex> lock{state_mutex};
-        current_machine = queued_machine;
+    std::lock_guard<std::mutex> lock{state_mutex};
+    current_machine = queued_machine;
+}
+
+/*
+    Batch Accumulators
+*/
+
+vine::batch_counter::batch_counter() {
+    slots_amount = get_threads_amount();
+    slots.reset(new slot[slots_amount]);
+}
+
+int64_t vine::batch_counter::snapshot() const {
+    int64_t sum = 0;
+    for (unsigned int i = 0; i < slots_amount; i++) 
+        sum += slots[i].value.load(std::memory_order_relaxed);
+    return sum;
+}
+
+void vine::batch_counter::reset() {
+    for (unsigned int i = 0; i < slots_amount; i++) 
+        slots[i].value.store(0, std::memory_order_relaxed);
+}
+
+vine::batch_histogram::batch_histogram() {
+    slots_amount = get_threads_amount();
+    slots.reset(new slot[slots_amount]);
+}
+
+vine::batch_histogram::snapshot_data vine::batch_histogram::snapshot() const {
+    snapshot_data res;
+
+    for (unsigned int i = 0; i < slots_amount; i++) {
+        auto& s = slots[i];
+        for (size_t b = 0; b < buckets_amount; b++) {
+            auto amount = s.buckets[b].load(std::memory_order_relaxed);
+            res.buckets[b] += amount;
+            res.count      += amount;
+        }
+        res.sum += s.sum.load(std::memory_order_relaxed);
+    }
+
+    return res;
+}
+
+void vine::batch_histogram::reset() {
+    for (unsigned int i = 0; i < slots_amount; i++) {
+        for (auto& b : slots[i].buckets) b.store(0, std::memory_order_relaxed);
+        slots[i].sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+double vine::batch_histogram::snapshot_data::mean() const {
+    return count ? (double)sum / count : 0.0;
+}
+
+uint64_t vine::batch_histogram::snapshot_data::percentile(double p) const {
+    if (count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * (count - 1));
+    uint64_t seen = 0;
+
+    for (size_t b = 0; b < buckets_amount; b++) {
+        seen += buckets[b];
+        if (seen > rank) return b == 0 ? 0 : (b == 64 ? UINT64_MAX : (uint64_t(1) << b) - 1);
+    }
+    return UINT64_MAX;
+}
+
+/*
+    Frame Arena
+*/
+
+#ifndef VINE_FRAME_ARENA_BLOCK_SIZE
+    #define VINE_FRAME_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+namespace {
+    std::unique_ptr<vine::frame_arena[]> frame_arenas;
+    size_t                               frame_arenas_per_thread = 1;  //two with pipelined machines, for overlapping runs
+    std::atomic<uint64_t>                frame_epoch             = 0;  //number of the newest started machine run
+    thread_local uint64_t                local_frame_epoch       = 0;  //run of the function executed by this thread, 0 outside
+    thread_local vine::frame_arena*      local_frame_arenas      = nullptr;  //arenas of the worker running on this thread
+}
+
+void* vine::frame_arena::allocate_block(size_t size, size_t alignment) {
+    //next block doubles arena, so growing takes log of final size allocations
+    auto block_size = std::max<size_t>({VINE_FRAME_ARENA_BLOCK_SIZE, blocks_size, size + alignment});
+
+    blocks.emplace_back(new unsigned char[block_size]);
+    blocks_size += block_size;
+
+    current = blocks.back().get();
+    end     = current + block_size;
+
+    return allocate(size, alignment);
+}
+
+void vine::frame_arena::reset() {
+    if (blocks.size() > 1) {
+        blocks.clear();
+        blocks.emplace_back(new unsigned char[blocks_size]);
+    }
+
+    current = blocks.empty() ? nullptr : blocks.back().get();
+    end     = current ? current + blocks_size : nullptr;
+}
+
+vine::frame_arena& vine::get_local_frame_arena() {
+    //functions allocate for their own run, anything else for the newest one
+    auto epoch = local_frame_epoch ? local_frame_epoch : frame_epoch.load(std::memory_order_relaxed);
+
+    //threads outside of the pool, like main thread in library mode, own separate arena, since they share id 0 with a worker
+    thread_local vine::frame_arena outside_arena;
+
+    //overlapping runs are consecutive, so they never share an arena
+    auto& arena = local_frame_arenas ? local_frame_arenas[epoch % frame_arenas_per_thread] : outside_arena;
+
+    //only owning thread touches the arena, so reset can not race with tasks still running
+    if (arena.epoch != epoch) {
+        arena.reset();
+        arena.epoch = epoch;
     }
+
+    return arena;
+}
+
+static void alloc_frame_arenas(size_t size, size_t per_thread) {
+    frame_arenas_per_thread = per_thread;
+    frame_arenas.reset(new vine::frame_arena[size * per_thread]);
+}
+
+// binds arenas of the worker id to this thread
+static void attach_frame_arenas(size_t thread_id) {
+    local_frame_arenas = &frame_arenas[thread_id * frame_arenas_per_thread];
 }
 
 /*
@@ -65,6 +320,7 @@ namespace {
     template<class node_object>
     struct executable_graph_node {
         node_object         object;
+        const void*         link = nullptr;  //link object which created the node
         std::vector<size_t> dependant;
         size_t              depedencies;
     };
@@ -80,12 +336,26 @@ namespace {
         executable_graph<const vine::stage*>
     > machines_reg;
 
+    // function linked to stage; parallel for nodes have range_body set instead of func
+    struct func_node_object {
+        vine::func       func       = nullptr;
+        vine::range_func range_body = nullptr;
+        size_t           range      = 0;
+        size_t           grain      = 0;
+    };
+
     std::unordered_map<
         const vine::stage*,
-        executable_graph<vine::func>        
+        executable_graph<func_node_object>        
     > stages_reg;
 
     std::unordered_map<const void*, size_t> link_object_to_graph_id;
+
+    // stage links of pipelined machine, paired with stage links of the previous run they wait for
+    std::unordered_map<
+        const vine::machine*,
+        std::vector<std::pair<const void*, const void*>>
+    > pipelines_reg;
 }
 
 static executable_graph<const vine::stage*>& get_machine_impl(const vine::machine& m) {
@@ -94,7 +364,7 @@ static executable_graph<const vine::stage*>& get_machine_impl(const vine::machin
     return itr->second;
 }
 
-static executable_graph<vine::func>& get_stage_impl(const vine::stage& m) {
+static executable_graph<func_node_object>& get_stage_impl(const vine::stage& m) {
     auto itr = stages_reg.find(&m);
     if (itr == stages_reg.end()) itr = stages_reg.insert({&m, {}}).first;
     return itr->second;
@@ -128,6 +398,7 @@ void link_node(
     auto& this_node    = graph.nodes[this_node_id];
 
     this_node.object            = node_obj;
+    this_node.link              = node_link_object_ptr;
     this_node.depedencies = depedencies.size();
 
     for (auto& dep_link : depedencies) {
@@ -163,14 +434,38 @@ vine::func_stage_link::func_stage_link(
     link_node(
         this, 
         graph,
-        func,
+        func_node_object{func},
+        depedencies
+    );
+}
+
+vine::parallel_for_stage_link::parallel_for_stage_link(
+    size_t range, size_t grain, range_func body, const stage& target, const std::initializer_list<const func_stage_link*>& depedencies
+) {
+    auto& graph = get_stage_impl(target);
+
+    link_node<func_node_object, func_stage_link>(
+        this, 
+        graph,
+        func_node_object{nullptr, body, range, grain},
         depedencies
     );
 }
 
+vine::pipeline_machine_link::pipeline_machine_link(
+    const machine& target, const std::initializer_list<previous_run_depedency>& depedencies
+) {
+    auto& pipeline = pipelines_reg[&target];
+
+    for (auto& dep : depedencies) 
+        pipeline.push_back({dep.stage, dep.depedency});
+}
+
+//runtime may be created again, so lists are rebuilt
 void find_independants() {
     for (auto& pair : machines_reg) {
         auto& graph = pair.second;
+        graph.independant.clear();
         for (size_t i = 0; i < graph.nodes.size(); i++) {
             if (graph.nodes[i].depedencies) continue;
             graph.independant.push_back(i);
@@ -179,6 +474,7 @@ void find_independants() {
 
     for (auto& pair : stages_reg) {
         auto& graph = pair.second;
+        graph.independant.clear();
         for (size_t i = 0; i < graph.nodes.size(); i++) {
             if (graph.nodes[i].depedencies) continue;
             graph.independant.push_back(i);
@@ -187,296 +483,2622 @@ void find_independants() {
 }
 
 /*
-    Thread Pool
+    Execution Plans
 */
 
-static void thread_worker_loop(unsigned int thread_id);
+//timestamps are taken only if anything records them
+#if defined(VINE_PROFILER) || defined(VINE_STATS)
+    #define VINE_RECORD_TIMES
+#endif
 
 namespace {
-    thread_local unsigned int   thread_id;
-    bool                        threads_should_terminate = false;
-    std::vector<std::thread>    thread_pool;
-}
+    // each counter lives on it's own cache line, so unrelated nodes do not share coherence traffic
+    struct alignas(VINE_CACHE_LINE_SIZE) padded_counter {
+        std::atomic<uint32_t> value;
+    };
 
-static void alloc_thread_pool(size_t size) {
-    threads_should_terminate = false;
-    for (size_t i = 0; i < size; i++) 
-        thread_pool.push_back(std::thread{thread_worker_loop, i});
-}
+    // plain twin of padded_counter used as the initial image of counters
+    struct alignas(VINE_CACHE_LINE_SIZE) padded_initial_value {
+        uint32_t value;
+    };
 
-namespace {
-    extern std::condition_variable queues_update_cv;
-}
+    static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  sizeof(padded_counter)        == sizeof(padded_initial_value),
+                  "counters must be restorable by copying their initial image");
+
+    // live counters of machine run and their initial image, laid out as:
+    // [stages depedencies | stages remaining funcs | stages handoff | funcs depedencies | ranges next chunk | ranges remaining | remaining stages]
+    // the thread which decrements a counter to zero claims the node, so no lock is needed
+    struct counters_block {
+        std::unique_ptr<padded_counter[]>       counters;
+        std::unique_ptr<padded_initial_value[]> image;
+        size_t                                  size = 0;
+
+        uint32_t stages_amount = 0;
+        uint32_t funcs_amount  = 0;
+        uint32_t ranges_amount = 0;
+
+        void alloc(uint32_t stages, uint32_t funcs, uint32_t ranges) {
+            stages_amount = stages;
+            funcs_amount  = funcs;
+            ranges_amount = ranges;
+            size          = 3 * (size_t)stages + funcs + 2 * (size_t)ranges + 1;
+            counters.reset(new padded_counter[size]);
+            image.reset(new padded_initial_value[size]);
+        }
 
-static void free_thread_pool() {
-    threads_should_terminate = true;
-    queues_update_cv.notify_all();
-    for (auto& t : thread_pool) t.join();
-    thread_pool.clear();
-}
+        // restores all counters with single block copy
+        // must not be called while any worker processes the machine
+        void reset() {
+            std::memcpy((void*)counters.get(), image.get(), size * sizeof(padded_counter));
+            std::atomic_thread_fence(std::memory_order_release);
+        }
 
-/*
-    Execution Queues
-*/
+        std::atomic<uint32_t>& stage_depedencies(uint32_t stage_id) { return counters[stage_id].value; }
+        std::atomic<uint32_t>& stage_remaining_funcs(uint32_t stage_id) { return counters[stages_amount + stage_id].value; }
+        std::atomic<uint32_t>& stage_handoff(uint32_t stage_id) { return counters[2 * stages_amount + stage_id].value; }
+        std::atomic<uint32_t>& func_depedencies(uint32_t func_id) { return counters[3 * stages_amount + func_id].value; }
+        std::atomic<uint32_t>& range_next_chunk(uint32_t range_id) { return counters[3 * stages_amount + funcs_amount + range_id].value; }
+        std::atomic<uint32_t>& range_remaining(uint32_t range_id) { return counters[3 * stages_amount + funcs_amount + ranges_amount + range_id].value; }
+        std::atomic<uint32_t>& remaining_stages() { return counters[size - 1].value; }
+
+        uint32_t& initial_stage_depedencies(uint32_t stage_id) { return image[stage_id].value; }
+        uint32_t& initial_stage_remaining_funcs(uint32_t stage_id) { return image[stages_amount + stage_id].value; }
+        uint32_t& initial_stage_handoff(uint32_t stage_id) { return image[2 * stages_amount + stage_id].value; }
+        uint32_t& initial_func_depedencies(uint32_t func_id) { return image[3 * stages_amount + func_id].value; }
+        uint32_t& initial_range_next_chunk(uint32_t range_id) { return image[3 * stages_amount + funcs_amount + range_id].value; }
+        uint32_t& initial_range_remaining(uint32_t range_id) { return image[3 * stages_amount + funcs_amount + ranges_amount + range_id].value; }
+        uint32_t& initial_remaining_stages() { return image[size - 1].value; }
+    };
 
-namespace {
-    struct func_node_locant {
-        size_t stage_node_id;
-        size_t func_node_id;
+    struct node_stats;
+    struct machine_ticks;
+
+    // function node of flattened machine; dependants are ids into machine_plan::funcs
+    struct plan_func {
+        vine::func  func;
+        const void* link;
+        node_stats* stats;
+        uint32_t    stage_id;
+        uint32_t    dependants_begin;   //range in machine_plan::funcs_dependants
+        uint32_t    dependants_end;
+        uint32_t    depedencies;
+        uint32_t    range_id;           //id into machine_plan::ranges for parallel for nodes, no_range otherwise
     };
 
-    struct task_enqueued {
-        vine::task_promise promise;
-        vine::task         task_func;
-        std::any            arg;
+    constexpr uint32_t no_range = UINT32_MAX;
+
+    // loop of parallel for node split into chunks of grain indices
+    struct plan_range {
+        vine::range_func body;
+        size_t           range;
+        size_t           grain;
+        uint32_t         chunks;
     };
 
-    std::mutex                       queues_mutex;
-    std::condition_variable          queues_update_cv;
-    std::condition_variable          machine_completed_cv;
+    // deque entries with this bit are helper copies of parallel for node, pushed to spread it's chunks
+    constexpr uint32_t range_helper_bit = 0x80000000u;
+
+    // deque entries with this bit belong to the run in the second slot of pipelined machine
+    constexpr uint32_t run_slot_bit = 0x40000000u;
+    constexpr uint32_t func_id_mask = ~(range_helper_bit | run_slot_bit);
+
+    // stage handoff flags; whichever side sets it's flag second forwards the completed stage to the next run
+    constexpr uint32_t handoff_completed = 1;  //the stage completed in this run
+    constexpr uint32_t handoff_opened    = 2;  //the next run started
+
+    // stage node of flattened machine; owns continuous range of machine_plan::funcs
+    struct plan_stage {
+        const vine::stage* stage;
+        const void*        link;
+        node_stats*        stats;
+        uint32_t funcs_begin;
+        uint32_t funcs_end;
+        uint32_t independants_begin;   //range in machine_plan::stages_independant_funcs
+        uint32_t independants_end;
+        uint32_t dependants_begin;     //range in machine_plan::stages_dependants
+        uint32_t dependants_end;
+        uint32_t next_run_dependants_begin;  //range in machine_plan::stages_next_run_dependants
+        uint32_t next_run_dependants_end;
+        uint32_t depedencies;
+    };
 
-    //all of those are sync under queues_mutex
+    // state of a single machine run; pipelined machine alternates two of them, so the next run starts while current drains
+    struct plan_run {
+        counters_block          counters;
+        uint64_t                epoch = 0;            //frame epoch of the run
 
-    std::queue<func_node_locant>     funcs_queue;
-    std::queue<task_enqueued>        tasks_queue;
+#ifdef VINE_RECORD_TIMES
+        std::vector<uint64_t>   stages_release_time;  //written by thread releasing the stage, read by the one completing it
+        std::vector<uint64_t>   ranges_start_time;    //written by original executor, read by the completing one
+#endif
+    };
 
-    std::vector<size_t>              stages_depedencies_conters;
-    std::vector<size_t>              funcs_procesed_counters;
-    std::vector<std::vector<size_t>> funcs_depedencies_conters;
+    // contiguous form of machine graph and all of it's stages graphs
+    // execution uses only array indexing on it, without any registry lookups
+    struct machine_plan {
+        std::vector<plan_func>  funcs;
+        std::vector<plan_range> ranges;
+        std::vector<uint32_t>   funcs_dependants;
+        std::vector<plan_stage> stages;
+        std::vector<uint32_t>   stages_dependants;
+        std::vector<uint32_t>   stages_independant_funcs;
+        std::vector<uint32_t>   independant_stages;
+        std::vector<uint32_t>   stages_next_run_dependants;
+
+        plan_run                runs[2];
+        uint32_t                next_run  = 0;      //slot of the next run
+        bool                    pipelined = false;  //only pipelined machine uses the second slot
+
+        machine_ticks*          ticks     = nullptr; //pacing of fixed rate machine
+
+#ifdef VINE_STATS
+        uint64_t                executions = 0;     //machine executions since last prioritization
+#endif
+    };
 
-    std::atomic<size_t>              threads_working_on_machine = 0;
+    std::unordered_map<const vine::machine*, machine_plan> plans_reg;
 }
 
-/*
-    Tasks
-*/
+static node_stats*    get_node_stats(const void* link);
+static machine_ticks* get_machine_ticks(const vine::machine& m);
+static void           prioritize_plan(machine_plan& plan);
 
-struct vine::task_promise::implementation {
-    std::atomic<size_t>     promises;
-    std::atomic<bool>       completed;
-    std::condition_variable condition;
-    std::mutex              mutex;
-};
+static void compile_machine(const vine::machine& m, machine_plan& plan) {
+    auto& machine_graph = get_machine_impl(m);
 
-vine::task_promise vine::issue_task(task task, std::any arg) {
-    vine::task_promise tp;
-    tp.impl = new vine::task_promise::implementation;
+    plan = {};
+    plan.stages.resize(machine_graph.nodes.size());
 
-    tp.impl->promises  = 1;
-    tp.impl->completed = false;
+    for (size_t stage_id = 0; stage_id < machine_graph.nodes.size(); stage_id++) {
+        auto& stage_node  = machine_graph.nodes[stage_id];
+        auto& stage_graph = get_stage_impl(*stage_node.object);
+        auto& ps          = plan.stages[stage_id];
 
-    task_enqueued te;
-    te.promise   = tp;
-    te.task_func = task;
-    te.arg       = std::move(arg);
+        auto funcs_offset = (uint32_t)plan.funcs.size();
 
-    std::lock_guard<std::mutex> lock{queues_mutex};
-    tasks_queue.push(std::move(te));
-    queues_update_cv.notify_one();
+        ps.stage       = stage_node.object;
+        ps.link        = stage_node.link;
+        ps.stats       = get_node_stats(stage_node.link);
+        ps.funcs_begin = funcs_offset;
+        ps.funcs_end   = funcs_offset + (uint32_t)stage_graph.nodes.size();
+        ps.depedencies = (uint32_t)stage_node.depedencies;
 
-    return tp;
-}
+        for (auto& func_node : stage_graph.nodes) {
+            auto& obj = func_node.object;
 
-vine::task_promise::~task_promise() {
-    if (impl && impl->promises.fetch_sub(1, std::memory_order_acq_rel) == 1) delete impl;
-    impl = nullptr;
-}
+            plan_func pf;
+            pf.func             = obj.func;
+            pf.link             = func_node.link;
+            pf.stats            = get_node_stats(func_node.link);
+            pf.range_id         = no_range;
+            pf.stage_id         = (uint32_t)stage_id;
+            pf.depedencies      = (uint32_t)func_node.depedencies;
+            pf.dependants_begin = (uint32_t)plan.funcs_dependants.size();
 
-vine::task_promise::task_promise(const task_promise& other) {
-    impl = other.impl;
-    if (impl) impl->promises.fetch_add(1, std::memory_order_acq_rel);
-}
+            for (auto dep_id : func_node.dependant) 
+                plan.funcs_dependants.push_back(funcs_offset + (uint32_t)dep_id);
 
-vine::task_promise& vine::task_promise::operator=(const task_promise& other) {
-    if (impl != other.impl) {
-        if (impl && impl->promises.fetch_sub(1, std::memory_order_acq_rel) == 1) {
-            delete impl;
+            pf.dependants_end = (uint32_t)plan.funcs_dependants.size();
+
+            if (obj.range_body) {
+                //chunk ids are counted in 32 bits
+                auto grain  = std::max<size_t>({obj.grain, 1, obj.range / (UINT32_MAX / 2) + 1});
+                auto chunks = (uint32_t)((obj.range + grain - 1) / grain);
+
+                pf.range_id = (uint32_t)plan.ranges.size();
+                plan.ranges.push_back({obj.range_body, obj.range, grain, chunks});
+            }
+
+            plan.funcs.push_back(pf);
         }
-        impl = other.impl;
-        if (impl) impl->promises.fetch_add(1, std::memory_order_acq_rel);
-    }
-    return *this; 
-}
 
-bool vine::task_promise::completed() {
-    if (!impl) return true;
-    return impl->completed;
-}
+        ps.independants_begin = (uint32_t)plan.stages_independant_funcs.size();
+        for (auto func_id : stage_graph.independant) 
+            plan.stages_independant_funcs.push_back(funcs_offset + (uint32_t)func_id);
+        ps.independants_end = (uint32_t)plan.stages_independant_funcs.size();
 
-void vine::task_promise::join() {
-    if (impl == nullptr || impl->completed) return;
-    std::unique_lock<std::mutex> lock{impl->mutex};
-    impl->condition.wait(lock, [&]{return impl->completed.load();});
-}
+        ps.dependants_begin = (uint32_t)plan.stages_dependants.size();
+        for (auto dep_id : stage_node.dependant) 
+            plan.stages_dependants.push_back((uint32_t)dep_id);
+        ps.dependants_end = (uint32_t)plan.stages_dependants.size();
 
-/*
-    Execution
-*/
+        if (stage_node.depedencies == 0) plan.independant_stages.push_back((uint32_t)stage_id);
+    }
 
-static void thread_worker_handle_node(func_node_locant& fnl) {
-    auto& machine_graph = get_machine_impl(*current_machine);
-    auto& stage_node    = machine_graph.nodes[fnl.stage_node_id];
-    auto& stage_graph   = get_stage_impl(*stage_node.object);
-    auto& func_node     = stage_graph.nodes[fnl.func_node_id];
+    plan.ticks = get_machine_ticks(m);
 
-    //execute func
-    auto func = func_node.object;
-    func();
+    //stages of pipelined machine wait for themselves and listed stages of the previous run
+    std::vector<std::vector<uint32_t>> next_run_dependants(plan.stages.size());
 
-    funcs_procesed_counters[fnl.stage_node_id]--;
+    auto pipeline = pipelines_reg.find(&m);
+    if (pipeline != pipelines_reg.end()) {
+        plan.pipelined = true;
 
-    //invoke next stage's functions
-    if (func_node.dependant.size() != 0) {
-        auto& dep_count_vec = funcs_depedencies_conters[fnl.stage_node_id];
-        std::lock_guard<std::mutex> lock(queues_mutex);
+        std::unordered_map<const void*, uint32_t> stage_ids;
+        for (uint32_t i = 0; i < plan.stages.size(); i++) {
+            stage_ids[plan.stages[i].link] = i;
+            next_run_dependants[i].push_back(i);
+        }
+
+        //links of other machines are ignored
+        for (auto& dep : pipeline->second) {
+            auto stage_itr = stage_ids.find(dep.first);
+            auto dep_itr   = stage_ids.find(dep.second);
+            if (stage_itr == stage_ids.end() || dep_itr == stage_ids.end()) continue;
 
-        for (auto& dep_id : func_node.dependant) {
-            auto& count = dep_count_vec.at(dep_id);
-            count--;
+            next_run_dependants[dep_itr->second].push_back(stage_itr->second);
+        }
+    }
 
-            if (count != 0) continue;
+    for (uint32_t i = 0; i < plan.stages.size(); i++) {
+        auto& ps = plan.stages[i];
 
-            funcs_queue.push({fnl.stage_node_id, dep_id});
-            funcs_procesed_counters[fnl.stage_node_id]++;
-            queues_update_cv.notify_one();
+        ps.next_run_dependants_begin = (uint32_t)plan.stages_next_run_dependants.size();
+        for (auto dep_id : next_run_dependants[i]) {
+            plan.stages_next_run_dependants.push_back(dep_id);
+            plan.stages[dep_id].depedencies++;
         }
+        ps.next_run_dependants_end = (uint32_t)plan.stages_next_run_dependants.size();
     }
-    //check if can invoke next stages since node has no dependants
-    else if (funcs_procesed_counters[fnl.stage_node_id] == 0) {
-        for (auto& dep_stage_node_id : stage_node.dependant) {
-            auto& count = stages_depedencies_conters[dep_stage_node_id];
-            count--;
 
-            if (count != 0) continue;
+    //build initial counters image of each used run slot
+    for (auto& run : plan.runs) {
+        auto& counters = run.counters;
+        counters.alloc((uint32_t)plan.stages.size(), (uint32_t)plan.funcs.size(), (uint32_t)plan.ranges.size());
 
-            auto& dep_stage_node  = *machine_graph.nodes[dep_stage_node_id].object;
-            auto& dep_stage_graph = get_stage_impl(dep_stage_node);
+        for (uint32_t i = 0; i < plan.stages.size(); i++) {
+            auto& ps = plan.stages[i];
+            counters.initial_stage_depedencies(i)     = ps.depedencies;
+            counters.initial_stage_remaining_funcs(i) = ps.funcs_end - ps.funcs_begin;
+            counters.initial_stage_handoff(i)         = 0;
+        }
 
-            for (auto& indpendant_func_node_id : dep_stage_graph.independant) {
-                funcs_queue.push({dep_stage_node_id, indpendant_func_node_id});
-                queues_update_cv.notify_one();
-            }
+        for (uint32_t i = 0; i < plan.funcs.size(); i++) 
+            counters.initial_func_depedencies(i) = plan.funcs[i].depedencies;
+
+        //the remaining counter also holds one token of every executor, so it's helper copies can not outlive the node
+        for (uint32_t i = 0; i < plan.ranges.size(); i++) {
+            counters.initial_range_next_chunk(i) = 0;
+            counters.initial_range_remaining(i)  = plan.ranges[i].chunks + 1;
         }
+
+        counters.initial_remaining_stages() = (uint32_t)plan.stages.size();
+
+#ifdef VINE_RECORD_TIMES
+        run.stages_release_time.resize(plan.stages.size());
+        run.ranges_start_time.resize(plan.ranges.size());
+#endif
+
+        if (!plan.pipelined) break;
+    }
+
+    //the first run takes over from completed one, so it's stages wait only within the run
+    if (plan.pipelined) {
+        auto& counters = plan.runs[1].counters;
+        counters.reset();
+        for (uint32_t i = 0; i < plan.stages.size(); i++) 
+            counters.stage_handoff(i).store(handoff_completed, std::memory_order_relaxed);
     }
+
+    prioritize_plan(plan);
 }
 
-static void thread_worker_handle_task(task_enqueued& e) {
-    e.task_func(std::move(e.arg));
-        
-    std::lock_guard lock(e.promise.impl->mutex);
-    e.promise.impl->completed.store(true);
-    e.promise.impl->condition.notify_all();
+void compile_machines() {
+    for (auto& pair : machines_reg) 
+        compile_machine(*pair.first, plans_reg[pair.first]);
 }
 
-unsigned int vine::get_thread_id() {
-    return thread_id;
+static machine_plan& get_machine_plan(const vine::machine& m) {
+    auto itr = plans_reg.find(&m);
+    if (itr == plans_reg.end()) {
+        itr = plans_reg.try_emplace(&m).first;
+        compile_machine(m, itr->second);
+    }
+    return itr->second;
 }
 
-static void thread_worker_loop(unsigned int thread_id_arg) {
-    //Todo: Exceptions
+/*
+    Work Stealing Deque
+*/
 
-    // Set Local Id
-    thread_id = thread_id_arg;
+namespace {
+    // Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models")
+    // push and pop may be called only by the owner thread, steal by any thread
+    template<class T>
+    class work_stealing_deque {
+        static_assert(std::atomic<T>::is_always_lock_free, "deque items must be lock free atomics");
+
+        struct ring {
+            int64_t                          capacity;
+            std::unique_ptr<std::atomic<T>[]> items;
+
+            ring(int64_t capacity) : capacity(capacity), items(new std::atomic<T>[capacity]) {};
+
+            T    get(int64_t i)      { return items[i & (capacity - 1)].load(std::memory_order_relaxed); }
+            void put(int64_t i, T x) { items[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+        };
+
+        std::atomic<int64_t>               top    = 0;
+        std::atomic<int64_t>               bottom = 0;
+        std::atomic<ring*>                 array;
+        std::vector<std::unique_ptr<ring>> rings; //old rings are kept alive since thieves may still read them
+
+        ring* grow(ring* old, int64_t b, int64_t t) {
+            auto bigger = new ring(old->capacity * 2);
+            for (int64_t i = t; i < b; i++) bigger->put(i, old->get(i));
+
+            rings.emplace_back(bigger);
+            array.store(bigger, std::memory_order_release);
+            return bigger;
+        }
 
-    while (!threads_should_terminate) {
-        std::unique_lock lock(queues_mutex);
+    public:
+        work_stealing_deque(int64_t capacity = 256) {
+            rings.emplace_back(new ring(capacity));
+            array.store(rings.back().get(), std::memory_order_relaxed);
+        }
 
-        bool should_work = threads_should_terminate ||
-                        !funcs_queue.empty()        ||
-                        !tasks_queue.empty();
+        void push(T x) {
+            auto b = bottom.load(std::memory_order_relaxed);
+            auto t = top.load(std::memory_order_acquire);
+            auto a = array.load(std::memory_order_relaxed);
 
-        if (!should_work) {
-            if (funcs_queue.empty() && !threads_working_on_machine) 
-                machine_completed_cv.notify_all();
+            if (b - t > a->capacity - 1) a = grow(a, b, t);
 
-            queues_update_cv.wait(lock);
-            continue;
+            a->put(b, x);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
         }
 
-        if (threads_should_terminate) break;
+        bool pop(T& out) {
+            auto b = bottom.load(std::memory_order_relaxed) - 1;
+            auto a = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto t = top.load(std::memory_order_relaxed);
+
+            if (t > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+
+            out = a->get(b);
+            if (t != b) return true;
+
+            //last item, race against thieves
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
 
-        if (!funcs_queue.empty()) {
-            threads_working_on_machine++;
+        bool steal(T& out) {
+            auto t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto b = bottom.load(std::memory_order_acquire);
 
-            auto fnl = std::move(funcs_queue.front());
-            funcs_queue.pop();
+            if (t >= b) return false;
 
-            lock.~unique_lock();
-            thread_worker_handle_node(fnl);
+            auto a = array.load(std::memory_order_acquire);
+            out = a->get(t);
+            return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        }
 
-            threads_working_on_machine--;
+        bool empty() const {
+            auto b = bottom.load(std::memory_order_relaxed);
+            auto t = top.load(std::memory_order_relaxed);
+            return t >= b;
         }
-        else if (!tasks_queue.empty()) {
-            auto te = std::move(tasks_queue.front());
-            tasks_queue.pop();
-            
-            lock.~unique_lock();
-            thread_worker_handle_task(te);
+
+        // approximate while thieves steal
+        size_t size() const {
+            auto b = bottom.load(std::memory_order_relaxed);
+            auto t = top.load(std::memory_order_relaxed);
+            return t >= b ? 0 : (size_t)(b - t);
         }
-        else continue;
-    }
+    };
 }
 
-static void execute_current_machine() {
-    auto& machine_graph = get_machine_impl(*current_machine);
-    auto  stages_amount = machine_graph.nodes.size();
+/*
+    MPMC Queue
+*/
 
-    // Alloc Counters Space (no need for mutex lock, since no machine is processed by workers)
+namespace {
+    // bounded multi producer multi consumer queue (Vyukov); every cell carries sequence number
+    // which tells whether it is ready to be written or read at given position
+    template<class T>
+    class mpmc_queue {
+        struct cell {
+            std::atomic<size_t> sequence;
+            alignas(T) unsigned char storage[sizeof(T)];
+
+            T* data() { return reinterpret_cast<T*>(storage); }
+        };
+
+        std::unique_ptr<cell[]> cells;
+        size_t                  mask;
+
+        alignas(VINE_CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos = 0;
+        alignas(VINE_CACHE_LINE_SIZE) std::atomic<size_t> dequeue_pos = 0;
+
+    public:
+        // capacity must be power of two
+        mpmc_queue(size_t capacity) : cells(new cell[capacity]), mask(capacity - 1) {
+            for (size_t i = 0; i < capacity; i++) 
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
 
-    stages_depedencies_conters.clear();
+        ~mpmc_queue() {
+            T x;
+            while (try_pop(x));
+        }
 
-    for (auto& x : funcs_depedencies_conters) 
-        x.clear();
+        // returns false if queue is full
+        bool try_push(T&& x) {
+            cell* c;
+            auto  pos = enqueue_pos.load(std::memory_order_relaxed);
+
+            while (true) {
+                c = &cells[pos & mask];
+                auto seq = c->sequence.load(std::memory_order_acquire);
+                auto dif = (intptr_t)seq - (intptr_t)pos;
+
+                if (dif == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                }
+                else if (dif < 0) return false;
+                else pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
 
-    if (funcs_depedencies_conters.size() < stages_amount)
-        funcs_depedencies_conters.resize(stages_amount);
+            new (c->data()) T(std::move(x));
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
 
-    if (funcs_procesed_counters.size() < stages_amount)
-        funcs_procesed_counters.resize(stages_amount);
+        // returns false if queue is empty
+        bool try_pop(T& out) {
+            cell* c;
+            auto  pos = dequeue_pos.load(std::memory_order_relaxed);
+
+            while (true) {
+                c = &cells[pos & mask];
+                auto seq = c->sequence.load(std::memory_order_acquire);
+                auto dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+                if (dif == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                }
+                else if (dif < 0) return false;
+                else pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
 
-    //Push First Nodes
+            out = std::move(*c->data());
+            c->data()->~T();
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
 
-    std::unique_lock lock(queues_mutex);
+        // approximate; may report item which is still being written
+        bool empty() const {
+            return dequeue_pos.load(std::memory_order_relaxed) >= enqueue_pos.load(std::memory_order_relaxed);
+        }
+    };
+}
 
-    for (size_t stage_node_id = 0; stage_node_id < stages_amount; stage_node_id++) {
-        auto& stage_node = machine_graph.nodes[stage_node_id];
+/*
+    Worker Parking
+*/
 
-        stages_depedencies_conters.push_back(stage_node.depedencies);
+#ifndef VINE_SPIN_ITERATIONS
+    #define VINE_SPIN_ITERATIONS 64
+#endif
 
-        auto& stage_graph = get_stage_impl(*stage_node.object);
-        auto& target_vec = funcs_depedencies_conters[stage_node_id];
+#ifndef VINE_YIELD_ITERATIONS
+    #define VINE_YIELD_ITERATIONS 16
+#endif
 
-        for (size_t func_node_id = 0; func_node_id < stage_graph.nodes.size(); func_node_id++) {
-            auto& func_node = stage_graph.nodes[func_node_id];
-            target_vec.push_back(func_node.depedencies);
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define VINE_CPU_RELAX() _mm_pause()
+#elif defined(__x86_64__) || defined(__i386__)
+    #define VINE_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+    #define VINE_CPU_RELAX() asm volatile("yield")
+#else
+    #define VINE_CPU_RELAX() ((void)0)
+#endif
 
-            if (func_node.depedencies != 0 || stage_node.depedencies != 0) continue;
-                
-            //node has no depedencies; push it
-            funcs_queue.push({stage_node_id, func_node_id});
-            funcs_procesed_counters[stage_node_id]++;
+namespace {
+    // eventcount; waiter announces itself, re-checks it's condition and parks only if no notify happened since
+    // notifiers skip all synchronization when nobody waits
+    class eventcount {
+        std::atomic<uint64_t>   epoch   = 0;
+        std::atomic<uint32_t>   waiters = 0;
+        std::mutex              mutex;
+        std::condition_variable cv;
+
+    public:
+        uint64_t prepare_wait() {
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            return epoch.load(std::memory_order_seq_cst);
         }
-    }
 
-    queues_update_cv.notify_all();
-    machine_completed_cv.wait(lock);
-}
+        void cancel_wait() {
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
 
-int main() {
-    link_object_to_graph_id.clear();
+        void commit_wait(uint64_t key) {
+            std::unique_lock<std::mutex> lock{mutex};
+            cv.wait(lock, [&]{ return epoch.load(std::memory_order_relaxed) != key; });
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
 
-    apply_machine();
-    if (!current_machine) abort();  //no default machine provided
+        // returns false if timed out without notify
+        bool commit_wait_for(uint64_t key, std::chrono::milliseconds timeout) {
+            std::unique_lock<std::mutex> lock{mutex};
+            bool notified = cv.wait_for(lock, timeout, [&]{ return epoch.load(std::memory_order_relaxed) != key; });
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            return notified;
+        }
 
-    find_independants();
+        // wakes up to amount waiters; the published work must be visible before the call
+        void notify(size_t amount) {
+            if (amount == 0) return;
 
-    auto threads = vine::get_threads_amount();
-    alloc_thread_pool(threads);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto waiting = waiters.load(std::memory_order_relaxed);
+            if (waiting == 0) return;
 
-    while (!should_shutdown) {
-        execute_current_machine();
-        apply_machine();
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                epoch.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            if (amount >= waiting) {
+                cv.notify_all();
+                return;
+            }
+
+            for (size_t i = 0; i < amount; i++) cv.notify_one();
+        }
+
+        void notify_all() {
+            notify(SIZE_MAX);
+        }
+    };
+}
+
+/*
+    Profiler
+*/
+
+#ifndef VINE_PROFILER_CAPACITY
+    #define VINE_PROFILER_CAPACITY 65536
+#endif
+
+#ifndef VINE_PROFILER_OUTPUT
+    #define VINE_PROFILER_OUTPUT "vine_trace.json"
+#endif
+
+namespace {
+    std::mutex                                   debug_names_mutex;
+    std::unordered_map<const void*, std::string> debug_names;
+
+    enum class trace_kind : uint32_t { machine, stage, func, range, task, join, park };
+}
+
+static void set_debug_name_impl(const void* object, const char* name) {
+    std::lock_guard<std::mutex> lock{debug_names_mutex};
+    debug_names[object] = name;
+}
+
+void vine::set_debug_name(const stage& s, const char* name)              { set_debug_name_impl(&s, name); }
+void vine::set_debug_name(const machine& m, const char* name)            { set_debug_name_impl(&m, name); }
+void vine::set_debug_name(const func_stage_link& l, const char* name)    { set_debug_name_impl(&l, name); }
+void vine::set_debug_name(const stage_machine_link& l, const char* name) { set_debug_name_impl(&l, name); }
+
+// returns debug name of any of objects, or fallback made of prefix and id
+static std::string get_debug_name(std::initializer_list<const void*> objects, const char* prefix, uint32_t id) {
+    {
+        std::lock_guard<std::mutex> lock{debug_names_mutex};
+        for (auto object : objects) {
+            auto itr = debug_names.find(object);
+            if (itr != debug_names.end()) return itr->second;
+        }
+    }
+    return std::string(prefix) + " " + std::to_string(id);
+}
+
+#ifdef VINE_RECORD_TIMES
+// nanoseconds since the first call
+static uint64_t now_ns() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+#endif
+
+#ifdef VINE_PROFILER
+namespace {
+    struct trace_event {
+        uint64_t    begin;
+        uint64_t    end;
+        const void* object;
+        const void* link;
+        trace_kind  kind;
+        uint32_t    id;
+    };
+
+    // events of single thread; the oldest are overwritten once it is full
+    // written only by it's owner, so pushing takes no synchronization
+    struct alignas(VINE_CACHE_LINE_SIZE) trace_ring {
+        std::unique_ptr<trace_event[]> events{new trace_event[VINE_PROFILER_CAPACITY]};
+        std::atomic<uint64_t>          written = 0;
+
+        void push(const trace_event& e) {
+            auto w = written.load(std::memory_order_relaxed);
+            events[w % VINE_PROFILER_CAPACITY] = e;
+            written.store(w + 1, std::memory_order_release);
+        }
+    };
+
+    //one ring per thread id, and the last one for main thread if it is not a worker
+    std::unique_ptr<trace_ring[]> trace_rings;
+    size_t                        trace_rings_amount = 0;
+    thread_local trace_ring*      local_trace_ring   = nullptr;
+}
+
+static void alloc_profiler(size_t threads) {
+    trace_rings_amount = threads + 1;
+    trace_rings.reset(new trace_ring[trace_rings_amount]);
+}
+
+static void profiler_attach_thread(size_t ring_id) {
+    local_trace_ring = &trace_rings[ring_id];
+}
+
+static void trace(trace_kind kind, uint32_t id, const void* object, const void* link, uint64_t begin) {
+    if (local_trace_ring) local_trace_ring->push({begin, now_ns(), object, link, kind, id});
+}
+
+// records event spanning lifetime of the scope
+struct profile_scope {
+    trace_kind  kind;
+    uint32_t    id;
+    const void* object;
+    const void* link;
+    uint64_t    begin = now_ns();
+
+    profile_scope(trace_kind kind, uint32_t id, const void* object = nullptr, const void* link = nullptr) 
+        : kind(kind), id(id), object(object), link(link) {}
+    ~profile_scope() { trace(kind, id, object, link, begin); }
+};
+#else
+static void alloc_profiler(size_t) {}
+static void profiler_attach_thread(size_t) {}
+
+struct profile_scope {
+    profile_scope(trace_kind, uint32_t, const void* = nullptr, const void* = nullptr) {}
+};
+#endif
+
+// workers should be idle while dumping, otherwise the newest events may be torn
+bool vine::dump_profile(const char* path) {
+#ifdef VINE_PROFILER
+    if (!trace_rings) return false;
+
+    auto file = std::fopen(path, "w");
+    if (!file) return false;
+
+    auto write_name = [&](const std::string& name) {
+        std::fputc('"', file);
+        for (auto c : name) {
+            if (c == '"' || c == '\\') std::fputc('\\', file);
+            if ((unsigned char)c >= 0x20) std::fputc(c, file);
+        }
+        std::fputc('"', file);
+    };
+
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    bool   first    = true;
+    size_t async_id = 0;
+
+    for (size_t tid = 0; tid < trace_rings_amount; tid++) {
+        auto& ring    = trace_rings[tid];
+        auto  written = ring.written.load(std::memory_order_acquire);
+        auto  oldest  = written > VINE_PROFILER_CAPACITY ? written - VINE_PROFILER_CAPACITY : 0;
+
+        std::fprintf(file, "%s{\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"name\":\"thread_name\",\"args\":{\"name\":", first ? "" : ",\n", tid);
+        write_name(tid + 1 == trace_rings_amount ? std::string("main") : "worker " + std::to_string(tid));
+        std::fprintf(file, "}}");
+        first = false;
+
+        for (auto i = oldest; i < written; i++) {
+            auto& e = ring.events[i % VINE_PROFILER_CAPACITY];
+
+            std::string name;
+            switch (e.kind) {
+                case trace_kind::machine: name = get_debug_name({e.object}, "machine", e.id); break;
+                case trace_kind::stage:   name = get_debug_name({e.object, e.link}, "stage", e.id); break;
+                case trace_kind::func:    name = get_debug_name({e.link}, "func", e.id); break;
+                case trace_kind::range:   name = get_debug_name({e.link}, "parallel for", e.id); break;
+                case trace_kind::task:    name = "task"; break;
+                case trace_kind::join:    name = "join"; break;
+                case trace_kind::park:    name = "park"; break;
+            }
+
+            //stages span many threads, so they are async events
+            if (e.kind == trace_kind::stage) {
+                for (auto phase : {'b', 'e'}) {
+                    std::fprintf(file, ",\n{\"ph\":\"%c\",\"cat\":\"stage\",\"id\":%zu,\"pid\":0,\"tid\":%zu,\"ts\":%.3f,\"name\":", 
+                        phase, async_id, tid, (phase == 'b' ? e.begin : e.end) / 1000.0);
+                    write_name(name);
+                    std::fprintf(file, "}");
+                }
+                async_id++;
+                continue;
+            }
+
+            std::fprintf(file, ",\n{\"ph\":\"X\",\"pid\":0,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"name\":", 
+                tid, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+            write_name(name);
+            std::fprintf(file, "}");
+        }
+    }
+
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+/*
+    Statistics
+*/
+
+#ifndef VINE_STATS_WINDOW
+    #define VINE_STATS_WINDOW 128
+#endif
+
+#ifndef VINE_STATS_OUTPUT
+    #define VINE_STATS_OUTPUT "vine_stats.txt"
+#endif
+
+#ifndef VINE_PRIORITY_REFRESH
+    #define VINE_PRIORITY_REFRESH 256
+#endif
+
+namespace {
+    // durations of the newest executions of a node, in nanoseconds
+    // each node executes once per machine run, so it has single writer at a time; readers may come from any thread
+    struct alignas(VINE_CACHE_LINE_SIZE) node_stats {
+        std::atomic<uint64_t> samples[VINE_STATS_WINDOW] = {};
+        std::atomic<uint64_t> written = 0;
+
+        void record(uint64_t duration) {
+            auto w = written.load(std::memory_order_relaxed);
+            samples[w % VINE_STATS_WINDOW].store(duration, std::memory_order_relaxed);
+            written.store(w + 1, std::memory_order_release);
+        }
+
+        size_t amount() const {
+            return (size_t)std::min<uint64_t>(written.load(std::memory_order_acquire), VINE_STATS_WINDOW);
+        }
+
+        double mean() const {
+            auto n = amount();
+            if (n == 0) return 0;
+
+            uint64_t sum = 0;
+            for (size_t i = 0; i < n; i++) sum += samples[i].load(std::memory_order_relaxed);
+            return (double)sum / n;
+        }
+
+        vine::link_stats summary() const {
+            vine::link_stats res;
+            res.samples = amount();
+            if (res.samples == 0) return res;
+
+            uint64_t sorted[VINE_STATS_WINDOW];
+            for (size_t i = 0; i < res.samples; i++) sorted[i] = samples[i].load(std::memory_order_relaxed);
+            std::sort(sorted, sorted + res.samples);
+
+            uint64_t sum = 0;
+            for (size_t i = 0; i < res.samples; i++) sum += sorted[i];
+
+            res.mean = (double)sum / res.samples;
+            res.p50  = sorted[(res.samples - 1) * 50 / 100];
+            res.p99  = sorted[(res.samples - 1) * 99 / 100];
+            return res;
+        }
+    };
+
+    //created while compiling plans, so lookups during execution are read only
+    std::unordered_map<const void*, std::unique_ptr<node_stats>> links_stats;
+
+    // times the scope into node stats
+    struct stats_scope {
+#ifdef VINE_STATS
+        node_stats* stats;
+        uint64_t    begin = now_ns();
+
+        stats_scope(node_stats* stats) : stats(stats) {}
+        ~stats_scope() { stats->record(now_ns() - begin); }
+#else
+        stats_scope(node_stats*) {}
+#endif
+    };
+
+    // longest path from each node to the end of machine, weighted by mean durations
+    // functions without samples weigh 1, so without VINE_STATS it is the longest chain of functions
+    struct bottom_levels {
+        const machine_plan&   plan;
+        std::vector<double>   funcs;
+        std::vector<double>   stages_entry;  //from stage release
+        std::vector<double>   stages_exit;   //from stage completion
+        std::vector<bool>     funcs_done, entries_done, exits_done;
+
+        bottom_levels(const machine_plan& plan) : 
+            plan(plan),
+            funcs(plan.funcs.size()), stages_entry(plan.stages.size()), stages_exit(plan.stages.size()),
+            funcs_done(plan.funcs.size()), entries_done(plan.stages.size()), exits_done(plan.stages.size()) {}
+
+        double weight(uint32_t func_id) {
+            auto& stats = *plan.funcs[func_id].stats;
+            return stats.amount() ? stats.mean() : 1.0;
+        }
+
+        double func(uint32_t func_id) {
+            if (funcs_done[func_id]) return funcs[func_id];
+
+            auto& pf   = plan.funcs[func_id];
+            auto  next = stage_exit(pf.stage_id);
+            for (auto i = pf.dependants_begin; i < pf.dependants_end; i++) 
+                next = std::max(next, func(plan.funcs_dependants[i]));
+
+            funcs_done[func_id] = true;
+            return funcs[func_id] = weight(func_id) + next;
+        }
+
+        double stage_entry(uint32_t stage_id) {
+            if (entries_done[stage_id]) return stages_entry[stage_id];
+
+            auto& ps  = plan.stages[stage_id];
+            auto  res = stage_exit(stage_id);
+            for (auto i = ps.independants_begin; i < ps.independants_end; i++) 
+                res = std::max(res, func(plan.stages_independant_funcs[i]));
+
+            entries_done[stage_id] = true;
+            return stages_entry[stage_id] = res;
+        }
+
+        double stage_exit(uint32_t stage_id) {
+            if (exits_done[stage_id]) return stages_exit[stage_id];
+
+            auto& ps  = plan.stages[stage_id];
+            double res = 0;
+            for (auto i = ps.dependants_begin; i < ps.dependants_end; i++) 
+                res = std::max(res, stage_entry(plan.stages_dependants[i]));
+
+            exits_done[stage_id] = true;
+            return stages_exit[stage_id] = res;
+        }
+    };
+}
+
+// orders ready lists of plan ascending by bottom levels
+// deque owner pops the newest function, so the one on the longest remaining path executes first
+static void prioritize_plan(machine_plan& plan) {
+    bottom_levels levels{plan};
+
+    //compute all levels up front, so sorting does not read lists it is reordering
+    for (uint32_t i = 0; i < plan.stages.size(); i++) levels.stage_entry(i);
+    for (uint32_t i = 0; i < plan.funcs.size(); i++)  levels.func(i);
+
+    auto by_func  = [&](uint32_t a, uint32_t b) { return levels.funcs[a] < levels.funcs[b]; };
+    auto by_stage = [&](uint32_t a, uint32_t b) { return levels.stages_entry[a] < levels.stages_entry[b]; };
+
+    auto& fd = plan.funcs_dependants;
+    for (auto& pf : plan.funcs) 
+        std::sort(fd.begin() + pf.dependants_begin, fd.begin() + pf.dependants_end, by_func);
+
+    auto& si = plan.stages_independant_funcs;
+    auto& sd = plan.stages_dependants;
+    for (auto& ps : plan.stages) {
+        std::sort(si.begin() + ps.independants_begin, si.begin() + ps.independants_end, by_func);
+        std::sort(sd.begin() + ps.dependants_begin, sd.begin() + ps.dependants_end, by_stage);
+    }
+
+    std::sort(plan.independant_stages.begin(), plan.independant_stages.end(), by_stage);
+}
+
+static node_stats* get_node_stats(const void* link) {
+    auto& stats = links_stats[link];
+    if (!stats) stats.reset(new node_stats);
+    return stats.get();
+}
+
+vine::link_stats vine::get_link_stats(const func_stage_link& link) {
+    auto itr = links_stats.find(&link);
+    return itr == links_stats.end() ? link_stats{} : itr->second->summary();
+}
+
+vine::link_stats vine::get_link_stats(const stage_machine_link& link) {
+    auto itr = links_stats.find(&link);
+    return itr == links_stats.end() ? link_stats{} : itr->second->summary();
+}
+
+vine::critical_path vine::get_critical_path(const machine& m) {
+    critical_path res;
+
+    auto itr = plans_reg.find(&m);
+    if (itr == plans_reg.end()) return res;
+
+    auto&         plan = itr->second;
+    bottom_levels levels{plan};
+
+    //start at the longest independant stage and follow the longest continuation
+    int64_t stage_id = -1;
+    for (auto id : plan.independant_stages) 
+        if (stage_id < 0 || levels.stage_entry(id) > levels.stage_entry((uint32_t)stage_id)) stage_id = id;
+    if (stage_id < 0) return res;
+
+    res.length = levels.stage_entry((uint32_t)stage_id);
+
+    //walk from stage release
+    while (stage_id >= 0) {
+        auto& ps = plan.stages[stage_id];
+        res.stages.push_back(static_cast<const stage_machine_link*>(ps.link));
+
+        auto    best    = levels.stage_exit((uint32_t)stage_id);
+        int64_t func_id = -1;
+
+        for (auto i = ps.independants_begin; i < ps.independants_end; i++) {
+            auto id = plan.stages_independant_funcs[i];
+            if (levels.func(id) > best) { best = levels.func(id); func_id = id; }
+        }
+
+        while (func_id >= 0) {
+            auto& pf = plan.funcs[func_id];
+            res.funcs.push_back(static_cast<const func_stage_link*>(pf.link));
+
+            auto    next_best = levels.stage_exit(pf.stage_id);
+            int64_t next      = -1;
+            for (auto i = pf.dependants_begin; i < pf.dependants_end; i++) {
+                auto id = plan.funcs_dependants[i];
+                if (levels.func(id) > next_best) { next_best = levels.func(id); next = id; }
+            }
+            func_id = next;
+        }
+
+        //walk from stage completion
+        auto    next_best = 0.0;
+        int64_t next      = -1;
+        for (auto i = ps.dependants_begin; i < ps.dependants_end; i++) {
+            auto id = plan.stages_dependants[i];
+            if (next < 0 || levels.stage_entry(id) > next_best) { next_best = levels.stage_entry(id); next = id; }
+        }
+
+        stage_id = next;
+    }
+
+    return res;
+}
+
+bool vine::dump_stats(const char* path) {
+    auto file = std::fopen(path, "w");
+    if (!file) return false;
+
+    auto print = [&](const char* indent, const std::string& name, const link_stats& st) {
+        std::fprintf(file, "%s%-40s mean %12.0f ns  p50 %10llu ns  p99 %10llu ns  (%zu samples)\n", 
+            indent, name.c_str(), st.mean, (unsigned long long)st.p50, (unsigned long long)st.p99, st.samples);
+    };
+
+    uint32_t machine_index = 0;
+    for (auto& pair : plans_reg) {
+        auto& plan = pair.second;
+        std::fprintf(file, "%s\n", get_debug_name({pair.first}, "machine", machine_index++).c_str());
+
+        for (uint32_t stage_id = 0; stage_id < plan.stages.size(); stage_id++) {
+            auto& ps = plan.stages[stage_id];
+            print("  ", get_debug_name({ps.stage, ps.link}, "stage", stage_id), ps.stats->summary());
+
+            for (auto func_id = ps.funcs_begin; func_id < ps.funcs_end; func_id++) 
+                print("    ", get_debug_name({plan.funcs[func_id].link}, "func", func_id), plan.funcs[func_id].stats->summary());
+        }
+
+        if (plan.ticks) {
+            auto ticks = get_tick_stats(*pair.first);
+            std::fprintf(file, "  ticks %llu, deadline misses %llu\n", (unsigned long long)ticks.ticks, (unsigned long long)ticks.deadline_misses);
+            print("  ", "frame time", ticks.frame_time);
+            print("  ", "tick jitter", ticks.jitter);
+        }
+
+        auto path = get_critical_path(*pair.first);
+        std::fprintf(file, "  critical path %.0f:\n", path.length);
+        for (auto link : path.funcs) {
+            auto  func_id = 0u;
+            while (plan.funcs[func_id].link != link) func_id++;
+            std::fprintf(file, "    %s\n", get_debug_name({link}, "func", func_id).c_str());
+        }
+        std::fprintf(file, "\n");
+    }
+
+    return std::fclose(file) == 0;
+}
+
+/*
+    Tick Scheduling
+*/
+
+#ifndef VINE_TICK_SPIN_US
+    #define VINE_TICK_SPIN_US 500
+#endif
+
+namespace {
+    using tick_clock = std::chrono::steady_clock;
+
+    // schedule and metrics of fixed rate machine; schedule is touched only by main thread
+    struct machine_ticks {
+        tick_clock::duration        period;
+        vine::deadline_miss_handler on_miss;
+
+        tick_clock::time_point      tick;            //scheduled start of the current run
+        tick_clock::time_point      started;         //actual start of the current run
+        uint64_t                    last_epoch = 0;  //frame epoch of the last run, tells whether schedule continues
+
+        std::atomic<uint64_t>       ticks           = 0;
+        std::atomic<uint64_t>       deadline_misses = 0;
+        node_stats                  frame_times;
+        node_stats                  jitters;
+    };
+
+    std::unordered_map<const vine::machine*, std::unique_ptr<machine_ticks>> ticks_reg;
+}
+
+static uint64_t to_ns(tick_clock::duration d) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+vine::tick_machine_link::tick_machine_link(const machine& target, double rate_hz, deadline_miss_handler on_miss) {
+    //period has to be representable by the clock, and not shorter than one of it's ticks
+    auto period = std::chrono::duration<double>(1.0 / rate_hz);
+    if (!std::isfinite(rate_hz) || !(rate_hz > 0) || period > tick_clock::duration::max()) abort();
+
+    auto clock_period = std::chrono::duration_cast<tick_clock::duration>(period);
+    if (clock_period <= tick_clock::duration::zero()) abort();
+
+    auto& ticks = ticks_reg[&target];
+    ticks.reset(new machine_ticks);
+
+    ticks->period  = clock_period;
+    ticks->on_miss = on_miss;
+}
+
+static machine_ticks* get_machine_ticks(const vine::machine& m) {
+    auto itr = ticks_reg.find(&m);
+    return itr == ticks_reg.end() ? nullptr : itr->second.get();
+}
+
+// sleeps until shortly before the tick, then spins, since sleep wakes up late by scheduler granularity
+static void wait_tick(machine_ticks& ticks) {
+    //schedule restarts whenever the machine is entered
+    if (ticks.last_epoch == 0 || ticks.last_epoch != frame_epoch.load(std::memory_order_relaxed)) {
+        ticks.tick = ticks.started = tick_clock::now();
+        return;
+    }
+
+    auto spin_from = ticks.tick - std::chrono::microseconds(VINE_TICK_SPIN_US);
+    if (tick_clock::now() < spin_from) std::this_thread::sleep_until(spin_from);
+    while (tick_clock::now() < ticks.tick) VINE_CPU_RELAX();
+
+    ticks.started = tick_clock::now();
+    ticks.jitters.record(to_ns(ticks.started - ticks.tick));
+}
+
+// records the run and schedules the next tick
+static void finish_tick(const vine::machine& m, machine_ticks& ticks) {
+    auto now = tick_clock::now();
+
+    ticks.frame_times.record(to_ns(now - ticks.started));
+    ticks.ticks.fetch_add(1, std::memory_order_relaxed);
+    ticks.last_epoch = frame_epoch.load(std::memory_order_relaxed);
+    ticks.tick      += ticks.period;
+
+    if (now <= ticks.tick) return;
+
+    ticks.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+    if (ticks.on_miss) ticks.on_miss(m, to_ns(now - ticks.tick));
+
+    //late runs are not caught up with bursts
+    ticks.tick = now;
+}
+
+vine::tick_stats vine::get_tick_stats(const machine& m) {
+    tick_stats res;
+
+    auto ticks = get_machine_ticks(m);
+    if (!ticks) return res;
+
+    res.ticks           = ticks->ticks.load(std::memory_order_relaxed);
+    res.deadline_misses = ticks->deadline_misses.load(std::memory_order_relaxed);
+    res.frame_time      = ticks->frame_times.summary();
+    res.jitter          = ticks->jitters.summary();
+    return res;
+}
+
+/*
+    Thread Placement
+*/
+
+#ifdef __linux__
+    #include <pthread.h>
+#endif
+
+#ifndef VINE_AFFINITY
+    #define VINE_AFFINITY "none"
+#endif
+
+namespace {
+    struct cpu_info {
+        int cpu;
+        int node;
+    };
+
+    //cpu assigned to each thread id, or -1 if the thread is not pinned, and numa node it belongs to
+    std::vector<int> threads_cpus;
+    std::vector<int> threads_nodes;
+
+    //victims of each function worker; workers of the same node come first
+    std::vector<std::vector<uint32_t>> steal_orders;
+}
+
+// parses linux cpu list format, like "0-3,8,10-11"
+static std::vector<int> parse_cpu_list(const char* list) {
+    std::vector<int> res;
+
+    while (*list) {
+        char* end;
+        auto first = std::strtol(list, &end, 10);
+        if (end == list) break;
+
+        auto last = first;
+        if (*end == '-') last = std::strtol(end + 1, &end, 10);
+
+        for (auto c = first; c <= last; c++) res.push_back((int)c);
+
+        list = end;
+        while (*list == ',' || *list == ' ' || *list == '\n') list++;
+    }
+
+    return res;
+}
+
+#ifdef __linux__
+static std::vector<int> read_cpu_list_file(const std::string& path) {
+    auto file = std::fopen(path.c_str(), "r");
+    if (!file) return {};
+
+    char line[4096] = {};
+    if (!std::fgets(line, sizeof(line), file)) line[0] = 0;
+    std::fclose(file);
+
+    return parse_cpu_list(line);
+}
+#endif
+
+// returns cpus this process may run on, ordered by numa node
+static std::vector<cpu_info> get_available_cpus() {
+    std::vector<cpu_info> res;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) 
+            if (CPU_ISSET(cpu, &set)) res.push_back({cpu, 0});
+    }
+
+    for (auto node : read_cpu_list_file("/sys/devices/system/node/online")) {
+        for (auto cpu : read_cpu_list_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")) {
+            for (auto& info : res) 
+                if (info.cpu == cpu) info.node = node;
+        }
+    }
+#endif
+
+    if (res.empty()) {
+        for (unsigned int cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) res.push_back({(int)cpu, 0});
+    }
+
+    std::stable_sort(res.begin(), res.end(), [](const cpu_info& a, const cpu_info& b) { return a.node < b.node; });
+    return res;
+}
+
+// assigns cpus to thread ids; mode comes from VINE_AFFINITY environment variable, or the compile flag of the same name
+// compact fills numa nodes one after another, scatter deals threads round robin across nodes, and cpu list pins them in order
+static void plan_threads_placement(size_t threads) {
+    auto env  = std::getenv("VINE_AFFINITY");
+    auto mode = std::string(env ? env : VINE_AFFINITY);
+
+    threads_cpus.assign(threads, -1);
+    threads_nodes.assign(threads, 0);
+
+    if (mode == "none" || mode.empty()) return;
+
+    auto cpus = get_available_cpus();
+    auto node_of = [&](int cpu) {
+        for (auto& info : cpus) if (info.cpu == cpu) return info.node;
+        return 0;
+    };
+
+    if (mode == "compact") {
+        for (size_t i = 0; i < threads; i++) threads_cpus[i] = cpus[i % cpus.size()].cpu;
+    }
+    else if (mode == "scatter") {
+        std::vector<std::vector<int>> nodes;
+        for (auto& info : cpus) {
+            if (nodes.empty() || node_of(nodes.back().front()) != info.node) nodes.emplace_back();
+            nodes.back().push_back(info.cpu);
+        }
+
+        for (size_t i = 0; i < threads; i++) {
+            auto& node = nodes[i % nodes.size()];
+            threads_cpus[i] = node[(i / nodes.size()) % node.size()];
+        }
+    }
+    else {
+        auto list = parse_cpu_list(mode.c_str());
+        if (list.empty()) return;
+
+        for (size_t i = 0; i < threads; i++) threads_cpus[i] = list[i % list.size()];
+    }
+
+    for (size_t i = 0; i < threads; i++) threads_nodes[i] = node_of(threads_cpus[i]);
+}
+
+static void pin_current_thread(size_t id) {
+#ifdef __linux__
+    if (threads_cpus[id] < 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(threads_cpus[id], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)id;
+#endif
+}
+
+namespace {
+#ifdef __linux__
+    cpu_set_t caller_affinity;                 //mask of the thread creating runtime
+    bool      caller_affinity_saved = false;
+#endif
+}
+
+// main thread worker pins the thread creating runtime, which in library mode belongs to the host application
+static void save_caller_affinity() {
+#ifdef __linux__
+    caller_affinity_saved = pthread_getaffinity_np(pthread_self(), sizeof(caller_affinity), &caller_affinity) == 0;
+#endif
+}
+
+static void restore_caller_affinity() {
+#ifdef __linux__
+    if (caller_affinity_saved) pthread_setaffinity_np(pthread_self(), sizeof(caller_affinity), &caller_affinity);
+    caller_affinity_saved = false;
+#endif
+}
+
+// workers without own deque (elastic ones) get all deques as victims
+static void build_steal_orders(size_t funcs_workers, size_t threads) {
+    steal_orders.assign(threads, {});
+
+    for (size_t id = 0; id < threads; id++) {
+        auto& order = steal_orders[id];
+
+        //rotation starting after this worker spreads thieves over victims
+        for (bool same_node : {true, false}) {
+            for (size_t i = 0; i < funcs_workers; i++) {
+                auto victim = (id + i + 1) % funcs_workers;
+                if (victim == id) continue;
+                if ((threads_nodes[victim] == threads_nodes[id]) == same_node) order.push_back((uint32_t)victim);
+            }
+        }
+    }
+}
+
+/*
+    Thread Pool
+*/
+
+#ifndef VINE_TASK_WORKERS
+    #define VINE_TASK_WORKERS 0
+#endif
+
+#ifndef VINE_TASK_FAIR_SHARE
+    #define VINE_TASK_FAIR_SHARE 0
+#endif
+
+static void thread_worker_loop(unsigned int thread_id);
+static void task_worker_loop(unsigned int thread_id);
+
+namespace {
+    thread_local unsigned int   thread_id;
+    std::atomic<bool>           threads_should_terminate = false;
+    std::vector<std::thread>    thread_pool;
+    std::atomic<size_t>         threads_started  = 0;   //threads which finished their setup
+    size_t                      threads_expected = 0;
+
+    //ids [0, funcs_workers_amount) execute functions, the rest are dedicated to tasks
+    size_t                      funcs_workers_amount = 0;
+    size_t                      tasks_workers_amount = 0;
+}
+
+namespace {
+    extern eventcount workers_parking;
+    extern eventcount tasks_workers_parking;
+
+    //parking of the worker running on this thread; null for non worker threads
+    thread_local eventcount* local_parking = nullptr;
+}
+
+static void free_elastic_workers();
+
+static void free_thread_pool() {
+    threads_should_terminate = true;
+    workers_parking.notify_all();
+    tasks_workers_parking.notify_all();
+    for (auto& t : thread_pool) t.join();
+    thread_pool.clear();
+
+    free_elastic_workers();
+}
+
+/*
+    Execution Queues
+*/
+
+#ifndef VINE_TASK_QUEUE_CAPACITY
+    #define VINE_TASK_QUEUE_CAPACITY 4096
+#endif
+
+//positions are wrapped with mask
+static_assert(VINE_TASK_QUEUE_CAPACITY > 0 && (VINE_TASK_QUEUE_CAPACITY & (VINE_TASK_QUEUE_CAPACITY - 1)) == 0,
+              "VINE_TASK_QUEUE_CAPACITY must be a power of two");
+
+namespace {
+    using task_state = vine::task_promise::implementation;
+
+    std::mutex                       queues_mutex;
+    eventcount                       workers_parking;       //workers executing functions
+    eventcount                       tasks_workers_parking; //workers dedicated to tasks
+    std::condition_variable          machine_completed_cv;
+
+    //each worker owns one deque of ids into current_plan->funcs
+    //newly ready functions are pushed locally and idle workers steal
+    std::vector<std::unique_ptr<work_stealing_deque<uint32_t>>> funcs_deques;
+    thread_local work_stealing_deque<uint32_t>*                 local_deque = nullptr;
+
+    machine_plan*                    current_plan = nullptr;
+
+    //tasks have their own queue, so submitting them never contends with functions
+    mpmc_queue<task_state*>          tasks_queue{VINE_TASK_QUEUE_CAPACITY};
+
+    //all of those are sync under queues_mutex
+
+    std::vector<uint32_t>            funcs_injection_queue; //functions pushed by non worker threads
+    size_t                           funcs_injection_head = 0;
+    std::queue<task_state*>          tasks_overflow_queue;  //tasks which did not fit into tasks_queue
+
+    //lets idle workers poll queues above without locking
+    std::atomic<size_t>              funcs_injection_size = 0;
+    std::atomic<size_t>              tasks_overflow_size  = 0;
+
+    std::atomic<size_t>              tasks_in_flight      = 0; //pushed tasks which did not complete yet
+
+#ifdef VINE_MAIN_THREAD_WORKER
+    std::atomic<bool>                main_thread_parked = false;
+#endif
+}
+
+// allocates one deque per function worker, and spawns core workers for all ids except those taken by main thread
+// ids in [size, threads) are left for elastic workers
+static void alloc_thread_pool(size_t size, size_t threads) {
+    threads_should_terminate = false;
+
+    //at least one thread must be left for functions
+    tasks_workers_amount = std::min<size_t>(VINE_TASK_WORKERS, size - 1);
+    funcs_workers_amount = size - tasks_workers_amount;
+
+    plan_threads_placement(threads);
+    build_steal_orders(funcs_workers_amount, threads);
+
+    //each worker allocates it's own deque, so it is first touched on the worker numa node
+    funcs_deques.clear();
+    funcs_deques.resize(funcs_workers_amount);
+
+#ifdef VINE_MAIN_THREAD_WORKER
+    //main thread takes id 0
+    pin_current_thread(0);
+    funcs_deques[0].reset(new work_stealing_deque<uint32_t>);
+
+    thread_id     = 0;
+    local_deque   = funcs_deques[0].get();
+    local_parking = &workers_parking;
+    profiler_attach_thread(0);
+    attach_frame_arenas(0);
+
+    size_t first_worker_id = 1;
+#else
+    //main thread records to the ring after all workers ones, elastic included
+    profiler_attach_thread(threads);
+
+    size_t first_worker_id = 0;
+#endif
+
+    threads_started  = 0;
+    threads_expected = size - first_worker_id;
+
+    for (size_t i = first_worker_id; i < funcs_workers_amount; i++) 
+        thread_pool.push_back(std::thread{thread_worker_loop, i});
+
+    for (size_t i = funcs_workers_amount; i < size; i++) 
+        thread_pool.push_back(std::thread{task_worker_loop, i});
+
+    while (threads_started.load(std::memory_order_acquire) != threads_expected) std::this_thread::yield();
+}
+
+// pins the worker and allocates it's thread local data; returns once all workers are ready, so their deques can be stolen from
+static void start_worker_thread(unsigned int id) {
+    pin_current_thread(id);
+    if (id < funcs_workers_amount) funcs_deques[id].reset(new work_stealing_deque<uint32_t>);
+
+    threads_started.fetch_add(1, std::memory_order_acq_rel);
+    while (threads_started.load(std::memory_order_acquire) != threads_expected) std::this_thread::yield();
+}
+
+// whether workers executing functions should also execute tasks
+static bool funcs_workers_run_tasks() {
+    return tasks_workers_amount == 0;
+}
+
+// pushes onto local deque of worker, or onto injection queue if called from other thread
+// caller must notify workers_parking after pushing
+static void push_func(uint32_t func_id) {
+    if (local_deque) {
+        local_deque->push(func_id);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock{queues_mutex};
+    funcs_injection_queue.push_back(func_id);
+    funcs_injection_size.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool steal_func(uint32_t& out) {
+    for (auto victim : steal_orders[thread_id]) 
+        if (funcs_deques[victim]->steal(out)) return true;
+    return false;
+}
+
+static bool has_pending_tasks() {
+    return !tasks_queue.empty() || tasks_overflow_size.load(std::memory_order_relaxed) != 0;
+}
+
+static bool has_pending_funcs() {
+    if (funcs_injection_size.load(std::memory_order_relaxed) != 0) return true;
+
+    for (auto& d : funcs_deques) 
+        if (!d->empty()) return true;
+    return false;
+}
+
+static void push_task(task_state* ts) {
+    tasks_in_flight.fetch_add(1, std::memory_order_relaxed);
+
+    if (!tasks_queue.try_push(std::move(ts))) {
+        std::lock_guard<std::mutex> lock{queues_mutex};
+        tasks_overflow_queue.push(ts);
+        tasks_overflow_size.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (funcs_workers_run_tasks()) workers_parking.notify(1);
+    else                           tasks_workers_parking.notify(1);
+}
+
+static bool pop_task(task_state*& out) {
+    if (tasks_queue.try_pop(out)) return true;
+    if (tasks_overflow_size.load(std::memory_order_relaxed) == 0) return false;
+
+    std::lock_guard<std::mutex> lock{queues_mutex};
+    if (tasks_overflow_queue.empty()) return false;
+
+    out = tasks_overflow_queue.front();
+    tasks_overflow_queue.pop();
+    tasks_overflow_size.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+/*
+    Tasks
+*/
+
+#ifndef VINE_TASK_STATES_CACHE
+    #define VINE_TASK_STATES_CACHE 64
+#endif
+
+namespace {
+    // edge between task and it's dependant; lives in predecessor's list until predecessor completes
+    struct task_continuation {
+        task_state*        dependant = nullptr;
+        task_continuation* next      = nullptr;
+        bool               embedded  = false;   //stored inside dependant state rather than on the heap
+    };
+
+    // marks list of continuations of completed task; continuations added later fire right away
+    task_continuation continuations_closed;
+}
+
+// task states are recycled, so they are constructed once and reused by following tasks
+struct vine::task_promise::implementation {
+    std::atomic<size_t>     promises  = 0;     //references held by promises, continuations and scheduling
+    std::atomic<bool>       completed = false;
+    std::atomic<uint32_t>   joiners   = 0;     //outside threads blocked on the condition; completion skips the lock without them
+
+    //workers joining keep working and park among idle ones, counted per parking lot they sleep in
+    std::atomic<uint32_t>   workers_joiners       = 0;
+    std::atomic<uint32_t>   tasks_workers_joiners = 0;
+    std::condition_variable condition;
+    std::mutex              mutex;
+
+    std::atomic<int64_t>            pending       = 0;       //unfinished depedencies; signed, since any-barriers go below zero
+    std::atomic<task_continuation*> continuations = nullptr; //tasks waiting on this one
+    task_continuation               first_edge;              //edge to the first depedency, so then() does not allocate
+
+    //task payload is constructed in place inside the storage
+    void (*invoke)(void* storage)  = nullptr;
+    void (*destroy)(void* storage) = nullptr;
+    alignas(std::max_align_t) unsigned char storage[VINE_TASK_INLINE_SIZE];
+
+    task_state* next_free = nullptr;
+};
+
+namespace {
+    // intrusive list of free task states
+    struct task_states_list {
+        task_state* head   = nullptr;
+        size_t      amount = 0;
+
+        void push(task_state* ts) {
+            ts->next_free = head;
+            head = ts;
+            amount++;
+        }
+
+        task_state* pop() {
+            auto ts = head;
+            head = ts->next_free;
+            amount--;
+            return ts;
+        }
+    };
+
+    // free states shared between threads; threads move states here in batches
+    struct task_states_global_pool {
+        std::mutex       mutex;
+        task_states_list states;
+
+        ~task_states_global_pool() {
+            while (states.head) delete states.pop();
+        }
+    } task_states_pool;
+
+    // per thread cache of free states; it makes acquiring and releasing states lock free in steady state
+    struct task_states_local_cache {
+        task_states_list states;
+
+        ~task_states_local_cache() {
+            std::lock_guard<std::mutex> lock{task_states_pool.mutex};
+            while (states.head) task_states_pool.states.push(states.pop());
+        }
+    };
+
+    thread_local task_states_local_cache task_states_cache;
+}
+
+static task_state* acquire_task_state() {
+    auto& local = task_states_cache.states;
+
+    if (!local.head) {
+        std::lock_guard<std::mutex> lock{task_states_pool.mutex};
+        auto& global = task_states_pool.states;
+        while (global.head && local.amount < VINE_TASK_STATES_CACHE / 2) local.push(global.pop());
+    }
+
+    auto ts = local.head ? local.pop() : new task_state;
+
+    ts->completed.store(false, std::memory_order_relaxed);
+    ts->pending.store(0, std::memory_order_relaxed);
+    ts->continuations.store(nullptr, std::memory_order_relaxed);
+    ts->invoke  = nullptr;
+    ts->destroy = nullptr;
+    return ts;
+}
+
+static void release_task_state(task_state* ts) {
+    if (ts->destroy) ts->destroy(ts->storage);
+
+    auto& local = task_states_cache.states;
+    local.push(ts);
+
+    if (local.amount <= VINE_TASK_STATES_CACHE) return;
+
+    std::lock_guard<std::mutex> lock{task_states_pool.mutex};
+    while (local.amount > VINE_TASK_STATES_CACHE / 2) task_states_pool.states.push(local.pop());
+}
+
+static void acquire_task_reference(task_state* ts) {
+    ts->promises.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void drop_task_reference(task_state* ts) {
+    if (ts->promises.fetch_sub(1, std::memory_order_acq_rel) == 1) release_task_state(ts);
+}
+
+namespace {
+    // payload of tasks issued with vine::task function pointer
+    struct function_task_payload {
+        vine::task task_func;
+        std::any   arg;
+    };
+
+    static_assert(sizeof(function_task_payload) <= VINE_TASK_INLINE_SIZE, "VINE_TASK_INLINE_SIZE is too small");
+}
+
+void* vine::detail::acquire_task(task_promise& promise) {
+    auto ts = acquire_task_state();
+
+    //reference of the promise
+    ts->promises.store(1, std::memory_order_relaxed);
+
+    promise = {};
+    promise.impl = ts;
+
+    return ts->storage;
+}
+
+static void complete_task_state(task_state* ts);
+
+// called once for every completed depedency of the task
+static void arrive_task_depedency(task_state* ts) {
+    if (ts->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    //scheduling reference passes to the queue; barriers have nothing to execute
+    if (ts->invoke) {
+        push_task(ts);
+        return;
+    }
+
+    complete_task_state(ts);
+    drop_task_reference(ts);
+}
+
+static void add_task_continuation(task_state* predecessor, task_continuation* edge) {
+    auto head = predecessor->continuations.load(std::memory_order_acquire);
+
+    do {
+        if (head == &continuations_closed) {
+            //predecessor already completed
+            auto dependant = edge->dependant;
+            if (!edge->embedded) delete edge;
+
+            arrive_task_depedency(dependant);
+            drop_task_reference(dependant);
+            return;
+        }
+
+        edge->next = head;
+    } while (!predecessor->continuations.compare_exchange_weak(
+        head, edge, std::memory_order_acq_rel, std::memory_order_acquire
+    ));
+}
+
+// sets the task depedent on all (or any) of given promises
+// the task has to own scheduling reference, it is pushed or completed once depedencies are met
+static void schedule_task_after(task_state* ts, const vine::task_promise* depedencies, size_t depedencies_amount, bool any) {
+    //the last arrival schedules, so the counter can not reach zero before all edges are added
+    ts->pending.store(any ? 1 : (int64_t)depedencies_amount + 1, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < depedencies_amount; i++) {
+        auto predecessor = depedencies[i].impl;
+
+        //edges hold reference, so the dependant outlives all of them
+        acquire_task_reference(ts);
+
+        if (!predecessor) {
+            arrive_task_depedency(ts);
+            drop_task_reference(ts);
+            continue;
+        }
+
+        auto edge = i == 0 ? &ts->first_edge : new task_continuation;
+        edge->dependant = ts;
+        edge->embedded  = i == 0;
+
+        add_task_continuation(predecessor, edge);
+    }
+
+    //for all-barrier this drops the guard arrival; any-barrier without depedencies completes right away
+    if (!any || depedencies_amount == 0) arrive_task_depedency(ts);
+}
+
+void vine::detail::submit_task(
+    const task_promise& promise, void (*invoke)(void*), void (*destroy)(void*), 
+    const task_promise* depedencies, size_t depedencies_amount
+) {
+    auto ts = promise.impl;
+    ts->invoke  = invoke;
+    ts->destroy = destroy;
+
+    //scheduling reference; held until the task completes
+    acquire_task_reference(ts);
+
+    if (depedencies_amount == 0) push_task(ts);
+    else                         schedule_task_after(ts, depedencies, depedencies_amount, false);
+}
+
+vine::task_promise vine::detail::make_task_barrier(const task_promise* depedencies, size_t depedencies_amount, bool any) {
+    task_promise tp;
+    acquire_task(tp);
+
+    acquire_task_reference(tp.impl);
+    schedule_task_after(tp.impl, depedencies, depedencies_amount, any);
+
+    return tp;
+}
+
+vine::task_promise vine::when_all(std::initializer_list<task_promise> promises) {
+    return detail::make_task_barrier(promises.begin(), promises.size(), false);
+}
+
+vine::task_promise vine::when_all(const std::vector<task_promise>& promises) {
+    return detail::make_task_barrier(promises.data(), promises.size(), false);
+}
+
+vine::task_promise vine::when_any(std::initializer_list<task_promise> promises) {
+    return detail::make_task_barrier(promises.begin(), promises.size(), true);
+}
+
+vine::task_promise vine::when_any(const std::vector<task_promise>& promises) {
+    return detail::make_task_barrier(promises.data(), promises.size(), true);
+}
+
+vine::task_promise vine::issue_task(task task, std::any arg) {
+    vine::task_promise tp;
+    auto storage = detail::acquire_task(tp);
+
+    new (storage) function_task_payload{task, std::move(arg)};
+
+    detail::submit_task(
+        tp,
+        [](void* storage) {
+            auto p = static_cast<function_task_payload*>(storage);
+            p->task_func(std::move(p->arg));
+        },
+        [](void* storage) {
+            static_cast<function_task_payload*>(storage)->~function_task_payload();
+        }
+    );
+
+    return tp;
+}
+
+vine::task_promise::~task_promise() {
+    if (impl) drop_task_reference(impl);
+    impl = nullptr;
+}
+
+vine::task_promise::task_promise(const task_promise& other) {
+    impl = other.impl;
+    if (impl) acquire_task_reference(impl);
+}
+
+vine::task_promise& vine::task_promise::operator=(const task_promise& other) {
+    if (impl != other.impl) {
+        if (impl) drop_task_reference(impl);
+        impl = other.impl;
+        if (impl) acquire_task_reference(impl);
+    }
+    return *this; 
+}
+
+bool vine::task_promise::completed() {
+    if (!impl) return true;
+    return impl->completed.load(std::memory_order_acquire);
+}
+
+static void thread_worker_join(task_state* ts);
+
+void vine::task_promise::join() {
+    if (impl == nullptr || impl->completed.load(std::memory_order_acquire)) return;
+
+    profile_scope scope{trace_kind::join, 0};
+
+    //blocked worker could be the one needed to run the task, so it keeps executing other work
+    if (local_parking) {
+        auto& joiners = local_parking == &tasks_workers_parking ? impl->tasks_workers_joiners : impl->workers_joiners;
+        joiners.fetch_add(1, std::memory_order_seq_cst);
+        thread_worker_join(impl);
+        joiners.fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
+
+    impl->joiners.fetch_add(1, std::memory_order_seq_cst);
+    {
+        std::unique_lock<std::mutex> lock{impl->mutex};
+        impl->condition.wait(lock, [&]{ return impl->completed.load(std::memory_order_acquire); });
+    }
+    impl->joiners.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/*
+    Elastic Workers
+*/
+
+#ifndef VINE_ELASTIC_IDLE_MS
+    #define VINE_ELASTIC_IDLE_MS 1000
+#endif
+
+namespace {
+    // thread id reserved for elastic worker
+    struct elastic_slot {
+        std::thread thread;
+        bool        running = false;  //retired thread exits on it's own, but still has to be joined
+    };
+
+    //all of those are sync under elastic_mutex
+    std::mutex          elastic_mutex;
+    elastic_slot        elastic_slots[VINE_ELASTIC_THREADS > 0 ? VINE_ELASTIC_THREADS : 1];
+    size_t              elastic_running = 0;
+
+    std::atomic<size_t> blocked_workers = 0;  //workers inside blocking region
+}
+
+static void elastic_worker_loop(unsigned int thread_id, bool tasks_role);
+
+// spawns worker in place of the blocked one, unless every blocked worker is already replaced or slots run out
+static void spawn_elastic_worker(bool tasks_role) {
+    std::lock_guard<std::mutex> lock{elastic_mutex};
+    if (threads_should_terminate || elastic_running >= blocked_workers.load(std::memory_order_relaxed)) return;
+
+    auto core_threads = funcs_workers_amount + tasks_workers_amount;
+
+    for (auto& slot : elastic_slots) {
+        if (slot.running) continue;
+
+        if (slot.thread.joinable()) slot.thread.join();
+
+        auto id = (unsigned int)(core_threads + (&slot - elastic_slots));
+
+        slot.running = true;
+        slot.thread  = std::thread{elastic_worker_loop, id, tasks_role};
+        elastic_running++;
+        return;
+    }
+}
+
+static void retire_elastic_worker(unsigned int id) {
+    std::lock_guard<std::mutex> lock{elastic_mutex};
+
+    auto& slot = elastic_slots[id - funcs_workers_amount - tasks_workers_amount];
+    if (!slot.running) return;  //pool is being freed
+
+    slot.running = false;
+    elastic_running--;
+}
+
+static void free_elastic_workers() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock{elastic_mutex};
+        for (auto& slot : elastic_slots) {
+            if (slot.thread.joinable()) threads.push_back(std::move(slot.thread));
+            slot.running = false;
+        }
+        elastic_running = 0;
+    }
+
+    //exiting workers may still retire, so they are joined without the lock
+    for (auto& t : threads) t.join();
+}
+
+vine::blocking_region::blocking_region() {
+    //only workers are replaced
+    active = local_parking != nullptr;
+    if (!active) return;
+
+    blocked_workers.fetch_add(1, std::memory_order_relaxed);
+    if (VINE_ELASTIC_THREADS > 0) spawn_elastic_worker(local_parking == &tasks_workers_parking);
+}
+
+vine::blocking_region::~blocking_region() {
+    if (active) blocked_workers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/*
+    Execution
+*/
+
+static size_t release_stage(uint32_t run, uint32_t stage_id);
+
+// visits ready list ordered by priority ascending in the order it should be pushed
+// deque owner pops the last pushed, so it goes ascending; injection queue pops the first, so other threads go descending
+template<class visitor>
+static void for_each_by_push_order(const std::vector<uint32_t>& list, uint32_t begin, uint32_t end, visitor visit) {
+    if (local_deque) {
+        for (auto i = begin; i < end; i++) visit(list[i]);
+    }
+    else {
+        for (auto i = end; i > begin; i--) visit(list[i - 1]);
+    }
+}
+
+// deque entry of function in given run slot
+static uint32_t make_entry(uint32_t run, uint32_t func_id) {
+    return run ? func_id | run_slot_bit : func_id;
+}
+
+// releases stages of the next run waiting for completed stage of the previous one; returns amount of pushed functions
+static size_t forward_stage(uint32_t next_run, uint32_t stage_id) {
+    auto&  plan       = *current_plan;
+    auto&  stage_node = plan.stages[stage_id];
+    auto&  counters   = plan.runs[next_run].counters;
+    size_t pushed     = 0;
+
+    for (auto i = stage_node.next_run_dependants_begin; i < stage_node.next_run_dependants_end; i++) {
+        auto dep_stage_id = plan.stages_next_run_dependants[i];
+        if (counters.stage_depedencies(dep_stage_id).fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+
+        pushed += release_stage(next_run, dep_stage_id);
+    }
+
+    return pushed;
+}
+
+// returns amount of pushed functions
+static size_t complete_stage(uint32_t run, uint32_t stage_id) {
+    auto&  plan       = *current_plan;
+    auto&  stage_node = plan.stages[stage_id];
+    auto&  counters   = plan.runs[run].counters;
+    size_t pushed     = 0;
+
+#ifdef VINE_PROFILER
+    trace(trace_kind::stage, stage_id, stage_node.stage, stage_node.link, plan.runs[run].stages_release_time[stage_id]);
+#endif
+
+#ifdef VINE_STATS
+    stage_node.stats->record(now_ns() - plan.runs[run].stages_release_time[stage_id]);
+#endif
+
+    for_each_by_push_order(plan.stages_dependants, stage_node.dependants_begin, stage_node.dependants_end, [&](uint32_t dep_stage_id) {
+        if (counters.stage_depedencies(dep_stage_id).fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+        pushed += release_stage(run, dep_stage_id);
+    });
+
+    //next run, if already started, waits for this stage; otherwise it's starting thread forwards the stage
+    if (plan.pipelined && (counters.stage_handoff(stage_id).fetch_or(handoff_completed, std::memory_order_acq_rel) & handoff_opened)) 
+        pushed += forward_stage(run ^ 1, stage_id);
+
+    //dependant stages were released before this decrement, so reaching zero means the run is done
+    if (counters.remaining_stages().fetch_sub(1, std::memory_order_acq_rel) == 1) {
+#ifdef VINE_MAIN_THREAD_WORKER
+        //main thread parks among workers
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (main_thread_parked.load(std::memory_order_relaxed)) workers_parking.notify_all();
+#else
+        std::lock_guard<std::mutex> lock(queues_mutex);
+        machine_completed_cv.notify_all();
+#endif
+    }
+
+    return pushed;
+}
+
+// returns amount of pushed functions
+static size_t release_stage(uint32_t run, uint32_t stage_id) {
+    auto& plan       = *current_plan;
+    auto& stage_node = plan.stages[stage_id];
+
+#ifdef VINE_RECORD_TIMES
+    plan.runs[run].stages_release_time[stage_id] = now_ns();
+#endif
+
+    //stage without functions completes right away
+    if (stage_node.funcs_begin == stage_node.funcs_end) 
+        return complete_stage(run, stage_id);
+
+    for_each_by_push_order(plan.stages_independant_funcs, stage_node.independants_begin, stage_node.independants_end, [&](uint32_t func_id) {
+        push_func(make_entry(run, func_id));
+    });
+
+    return stage_node.independants_end - stage_node.independants_begin;
+}
+
+static void complete_func(uint32_t run, uint32_t func_id);
+
+// executes chunks of parallel for node until none are left; returns whether this executor completed the node
+static bool execute_range(uint32_t run, uint32_t func_id, bool helper) {
+    auto& plan     = *current_plan;
+    auto  range_id = plan.funcs[func_id].range_id;
+    auto& range    = plan.ranges[range_id];
+    auto& counters = plan.runs[run].counters;
+
+#ifdef VINE_STATS
+    if (!helper) plan.runs[run].ranges_start_time[range_id] = now_ns();
+#endif
+
+    //original executor spreads the node onto idle workers
+    if (!helper && range.chunks > 1) {
+        auto helpers = (uint32_t)std::min<size_t>(range.chunks - 1, funcs_workers_amount - 1);
+        if (helpers) {
+            counters.range_remaining(range_id).fetch_add(helpers, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < helpers; i++) push_func(make_entry(run, func_id) | range_helper_bit);
+            workers_parking.notify(helpers);
+        }
+    }
+
+    profile_scope scope{trace_kind::range, func_id, nullptr, plan.funcs[func_id].link};
+
+    uint32_t done = 0;
+    while (true) {
+        auto chunk = counters.range_next_chunk(range_id).fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= range.chunks) break;
+
+        auto begin = chunk * range.grain;
+        range.body(begin, std::min(range.range, begin + range.grain));
+        done++;
+    }
+
+    //chunks done and token of this executor
+    return counters.range_remaining(range_id).fetch_sub(done + 1, std::memory_order_acq_rel) == done + 1;
+}
+
+static void thread_worker_handle_node(uint32_t entry) {
+    auto  func_id   = entry & func_id_mask;
+    auto  run       = (entry & run_slot_bit) ? 1u : 0u;
+    auto& func_node = current_plan->funcs[func_id];
+
+    //frame arena follows the run; joins may nest nodes of other runs
+    auto outer_frame_epoch = local_frame_epoch;
+    local_frame_epoch      = current_plan->runs[run].epoch;
+
+    //execute func; parallel for node is completed by it's last executor
+    bool completed = true;
+    if (func_node.range_id == no_range) {
+        profile_scope scope{trace_kind::func, func_id, nullptr, func_node.link};
+        stats_scope   timing{func_node.stats};
+        func_node.func();
+    }
+    else {
+        completed = execute_range(run, func_id, entry & range_helper_bit);
+
+#ifdef VINE_STATS
+        if (completed) func_node.stats->record(now_ns() - current_plan->runs[run].ranges_start_time[func_node.range_id]);
+#endif
+    }
+
+    local_frame_epoch = outer_frame_epoch;
+
+    if (completed) complete_func(run, func_id);
+}
+
+static void complete_func(uint32_t run, uint32_t func_id) {
+    auto& plan      = *current_plan;
+    auto& func_node = plan.funcs[func_id];
+    auto& counters  = plan.runs[run].counters;
+    auto  stage_id  = func_node.stage_id;
+
+    size_t pushed = 0;
+
+    //invoke next stage's functions
+    for_each_by_push_order(plan.funcs_dependants, func_node.dependants_begin, func_node.dependants_end, [&](uint32_t dep_id) {
+        if (counters.func_depedencies(dep_id).fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+        push_func(make_entry(run, dep_id));
+        pushed++;
+    });
+
+    //last function of the stage completes it
+    if (counters.stage_remaining_funcs(stage_id).fetch_sub(1, std::memory_order_acq_rel) == 1) 
+        pushed += complete_stage(run, stage_id);
+
+    //this worker pops one of pushed functions itself, wake others for the rest
+    if (pushed > 1) workers_parking.notify(pushed - 1);
+}
+
+static void complete_task_state(task_state* ts) {
+    ts->completed.store(true, std::memory_order_seq_cst);
+    if (ts->joiners.load(std::memory_order_seq_cst) != 0) {
+        std::lock_guard lock(ts->mutex);
+        ts->condition.notify_all();
+    }
+
+    //eventcount can't single out a joiner among idle workers, so only lots with one inside are woken fully
+    if (ts->workers_joiners.load(std::memory_order_seq_cst) != 0)       workers_parking.notify_all();
+    if (ts->tasks_workers_joiners.load(std::memory_order_seq_cst) != 0) tasks_workers_parking.notify_all();
+
+    //dependant tasks are enqueued by this thread, nobody has to wait on the promise
+    auto edge = ts->continuations.exchange(&continuations_closed, std::memory_order_acq_rel);
+    while (edge) {
+        auto next      = edge->next;
+        auto dependant = edge->dependant;
+        if (!edge->embedded) delete edge;
+
+        arrive_task_depedency(dependant);
+        drop_task_reference(dependant);
+
+        edge = next;
+    }
+}
+
+static void thread_worker_handle_task(task_state* ts) {
+    {
+        profile_scope scope{trace_kind::task, 0};
+        ts->invoke(ts->storage);
+    }
+    complete_task_state(ts);
+
+    //scheduling reference
+    drop_task_reference(ts);
+
+    tasks_in_flight.fetch_sub(1, std::memory_order_release);
+}
+
+unsigned int vine::get_thread_id() {
+    return thread_id;
+}
+
+// pops function pushed by non worker thread and executes it
+static bool thread_worker_handle_injected_func() {
+    if (funcs_injection_size.load(std::memory_order_relaxed) == 0) return false;
+
+    std::unique_lock lock(queues_mutex);
+    if (funcs_injection_head == funcs_injection_queue.size()) return false;
+
+    auto func_id = funcs_injection_queue[funcs_injection_head++];
+
+    //vector keeps it's capacity, so steady state pushes do not allocate
+    if (funcs_injection_head == funcs_injection_queue.size()) {
+        funcs_injection_queue.clear();
+        funcs_injection_head = 0;
+    }
+    funcs_injection_size.fetch_sub(1, std::memory_order_relaxed);
+
+    lock.unlock();
+    thread_worker_handle_node(func_id);
+    return true;
+}
+
+static bool thread_worker_handle_queued_task() {
+    task_state* ts;
+    if (!pop_task(ts)) return false;
+
+    thread_worker_handle_task(ts);
+    return true;
+}
+
+// one step of idle policy: spin, then yield, then park until notified
+// should_wake is checked after announcing the park, so it can not miss a notify
+// with non zero timeout, returns false if the park lasted whole timeout without notify
+template<class wake_predicate>
+static bool idle_step(
+    eventcount& parking, unsigned int& idle_rounds, wake_predicate should_wake, std::chrono::milliseconds timeout = {}
+) {
+    if (idle_rounds < VINE_SPIN_ITERATIONS) {
+        VINE_CPU_RELAX();
+        idle_rounds++;
+        return true;
+    }
+
+    if (idle_rounds < VINE_SPIN_ITERATIONS + VINE_YIELD_ITERATIONS) {
+        std::this_thread::yield();
+        idle_rounds++;
+        return true;
+    }
+
+    auto key      = parking.prepare_wait();
+    bool notified = true;
+
+    if (should_wake()) parking.cancel_wait();
+    else {
+        profile_scope scope{trace_kind::park, 0};
+        if (timeout.count()) notified = parking.commit_wait_for(key, timeout);
+        else                 parking.commit_wait(key);
+    }
+
+    idle_rounds = 0;
+    return notified;
+}
+
+// executes work the worker would normally take, until the task completes
+static void thread_worker_join(task_state* ts) {
+    auto completed = [&]{ return ts->completed.load(std::memory_order_acquire); };
+    bool run_tasks = !local_deque || funcs_workers_run_tasks();
+
+    unsigned int idle_rounds = 0;
+
+    while (!completed()) {
+        uint32_t func_id;
+
+        if (local_deque && (local_deque->pop(func_id) || steal_func(func_id))) {
+            thread_worker_handle_node(func_id);
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (local_deque && thread_worker_handle_injected_func()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (run_tasks && thread_worker_handle_queued_task()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        idle_step(*local_parking, idle_rounds, [&]{ 
+            return completed() || (local_deque && has_pending_funcs()) || (run_tasks && has_pending_tasks()); 
+        });
+    }
+}
+
+static void thread_worker_loop(unsigned int thread_id_arg) {
+    //Todo: Exceptions
+
+    start_worker_thread(thread_id_arg);
+
+    // Set Local Id
+    thread_id     = thread_id_arg;
+    local_deque   = funcs_deques[thread_id].get();
+    local_parking = &workers_parking;
+    profiler_attach_thread(thread_id);
+    attach_frame_arenas(thread_id);
+
+    bool         run_tasks        = funcs_workers_run_tasks();
+    unsigned int idle_rounds      = 0;
+    unsigned int funcs_since_task = 0;
+
+    auto should_wake = [&]{
+        return has_pending_funcs() || (run_tasks && has_pending_tasks()) || threads_should_terminate;
+    };
+
+    while (!threads_should_terminate) {
+        uint32_t func_id;
+
+#if VINE_TASK_FAIR_SHARE > 0
+        //fair share; do not let steady machine load starve tasks
+        if (run_tasks && funcs_since_task >= VINE_TASK_FAIR_SHARE) {
+            funcs_since_task = 0;
+            if (thread_worker_handle_queued_task()) continue;
+        }
+#endif
+
+        if (local_deque->pop(func_id) || steal_func(func_id)) {
+            thread_worker_handle_node(func_id);
+            idle_rounds = 0;
+            funcs_since_task++;
+            continue;
+        }
+
+        if (thread_worker_handle_injected_func()) {
+            idle_rounds = 0;
+            funcs_since_task++;
+            continue;
+        }
+
+        if (run_tasks && thread_worker_handle_queued_task()) {
+            idle_rounds      = 0;
+            funcs_since_task = 0;
+            continue;
+        }
+
+        idle_step(workers_parking, idle_rounds, should_wake);
+    }
+}
+
+static void task_worker_loop(unsigned int thread_id_arg) {
+    start_worker_thread(thread_id_arg);
+
+    thread_id     = thread_id_arg;
+    local_parking = &tasks_workers_parking;
+    profiler_attach_thread(thread_id);
+    attach_frame_arenas(thread_id);
+
+    unsigned int idle_rounds = 0;
+
+    while (!threads_should_terminate) {
+        if (thread_worker_handle_queued_task()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        idle_step(tasks_workers_parking, idle_rounds, []{ return has_pending_tasks() || threads_should_terminate; });
+    }
+}
+
+// elastic worker stands in for a blocked one; without own deque it steals functions, or takes tasks if it replaces task worker
+static void elastic_worker_loop(unsigned int thread_id_arg, bool tasks_role) {
+    pin_current_thread(thread_id_arg);
+
+    thread_id     = thread_id_arg;
+    local_parking = tasks_role ? &tasks_workers_parking : &workers_parking;
+    profiler_attach_thread(thread_id);
+    attach_frame_arenas(thread_id);
+
+    bool         run_funcs   = !tasks_role;
+    bool         run_tasks   = tasks_role || funcs_workers_run_tasks();
+    unsigned int idle_rounds = 0;
+
+    auto should_wake = [&]{
+        return (run_funcs && has_pending_funcs()) || (run_tasks && has_pending_tasks()) || threads_should_terminate;
+    };
+
+    while (!threads_should_terminate) {
+        uint32_t func_id;
+
+        if (run_funcs && steal_func(func_id)) {
+            thread_worker_handle_node(func_id);
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (run_funcs && thread_worker_handle_injected_func()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (run_tasks && thread_worker_handle_queued_task()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (!idle_step(*local_parking, idle_rounds, should_wake, std::chrono::milliseconds(VINE_ELASTIC_IDLE_MS))) {
+            retire_elastic_worker(thread_id);
+            return;
+        }
+    }
+}
+
+#ifdef VINE_MAIN_THREAD_WORKER
+// main thread works as one of workers until the machine completes
+// it executes only functions, unless there are no other workers to run tasks
+static void main_thread_work_on_machine(machine_plan& plan, uint32_t run) {
+    auto machine_completed = [&]{ return plan.runs[run].counters.remaining_stages().load(std::memory_order_acquire) == 0; };
+    unsigned int idle_rounds = 0;
+
+    while (!machine_completed()) {
+        uint32_t func_id;
+
+        if (local_deque->pop(func_id) || steal_func(func_id)) {
+            thread_worker_handle_node(func_id);
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (thread_pool.empty() && thread_worker_handle_queued_task()) {
+            idle_rounds = 0;
+            continue;
+        }
+
+        //completing thread has to know whether it should wake main thread
+        bool parks = idle_rounds >= VINE_SPIN_ITERATIONS + VINE_YIELD_ITERATIONS;
+        if (parks) main_thread_parked.store(true, std::memory_order_seq_cst);
+
+        idle_step(workers_parking, idle_rounds, [&]{ 
+            return has_pending_funcs() || (thread_pool.empty() && has_pending_tasks()) || machine_completed(); 
+        });
+
+        if (parks) main_thread_parked.store(false, std::memory_order_relaxed);
+    }
+
+    //functions of the next pipelined run may be left on main thread deque, which nobody else is woken for
+    if (auto left = local_deque->size()) workers_parking.notify(left);
+}
+#endif
+
+namespace {
+    //run of pipelined machine which may still execute after execute_current_machine returns
+    machine_plan* inflight_plan = nullptr;
+    uint32_t      inflight_run  = 0;
+}
+
+static void wait_run(machine_plan& plan, uint32_t run) {
+#ifdef VINE_MAIN_THREAD_WORKER
+    main_thread_work_on_machine(plan, run);
+#else
+    std::unique_lock lock(queues_mutex);
+    machine_completed_cv.wait(lock, [&]{ return plan.runs[run].counters.remaining_stages().load() == 0; });
+#endif
+}
+
+// waits until no run executes
+static void drain_pipeline() {
+    if (!inflight_plan) return;
+
+    wait_run(*inflight_plan, inflight_run);
+    inflight_plan = nullptr;
+}
+
+// starts run of current machine; pipelined machine returns once the previous run completes, leaving this one executing
+static void execute_current_machine() {
+    auto& plan = get_machine_plan(*current_machine);
+
+    //runs of diffrent machines do not overlap
+    if (inflight_plan != &plan) drain_pipeline();
+
+#ifdef VINE_STATS
+    //follow measured durations; ready lists must not change under executing run
+    if (++plan.executions == VINE_PRIORITY_REFRESH) {
+        plan.executions = 0;
+        drain_pipeline();
+        prioritize_plan(plan);
+    }
+#endif
+
+    //the previous run of pipelined machine still reads it
+    if (current_plan != &plan) current_plan = &plan;
+
+    //fixed rate machine waits for it's tick
+    if (plan.ticks) wait_tick(*plan.ticks);
+
+    profile_scope scope{trace_kind::machine, 0, current_machine};
+
+    // Reset Counters (no need for mutex lock, since the previous run in this slot completed)
+
+    auto  run      = plan.next_run;
+    auto& counters = plan.runs[run].counters;
+
+    counters.reset();
+    plan.runs[run].epoch = frame_epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    //Push First Nodes
+
+    size_t pushed = 0;
+    if (!plan.pipelined) {
+        //root stages go in priority order across stages too, not only within each of them
+        auto roots = (uint32_t)plan.independant_stages.size();
+        for_each_by_push_order(plan.independant_stages, 0, roots, [&](uint32_t stage_id) {
+            pushed += release_stage(run, stage_id);
+        });
+    }
+    else {
+        //stages already completed in the previous run are forwarded here, the rest by their completing threads
+        auto& previous = plan.runs[run ^ 1].counters;
+        for (uint32_t stage_id = 0; stage_id < plan.stages.size(); stage_id++) {
+            if (previous.stage_handoff(stage_id).fetch_or(handoff_opened, std::memory_order_acq_rel) & handoff_completed) 
+                pushed += forward_stage(run, stage_id);
+        }
+
+        plan.next_run = run ^ 1;
+    }
+
+#ifdef VINE_MAIN_THREAD_WORKER
+    //main thread takes one of pushed functions itself, unless it leaves pipelined run to workers
+    if (plan.pipelined)  workers_parking.notify(pushed);
+    else if (pushed > 1) workers_parking.notify(pushed - 1);
+#else
+    workers_parking.notify(pushed);
+#endif
+
+    if (!plan.pipelined) wait_run(plan, run);
+    else {
+        //at most two runs are in flight: this one and the previous, which must complete before the next starts
+        drain_pipeline();
+        inflight_plan = &plan;
+        inflight_run  = run;
+    }
+
+    if (plan.ticks) finish_tick(*current_machine, *plan.ticks);
+}
+
+/*
+    Runtime
+*/
+
+namespace {
+    bool runtime_alive = false;
+}
+
+vine::runtime::runtime() {
+    if (runtime_alive) abort();  //only one runtime may exist at a time
+    runtime_alive = true;
+
+    link_object_to_graph_id.clear();
+
+    find_independants();
+    compile_machines();
+
+    auto threads = vine::get_threads_amount();
+    alloc_frame_arenas(threads, pipelines_reg.empty() ? 1 : 2);
+    alloc_profiler(threads);
+
+    save_caller_affinity();
+    alloc_thread_pool(get_core_threads_amount(), threads);
+}
+
+// waits until workers execute all pushed tasks, including continuations they enqueue
+// states of tasks left in queues would leak with their continuations, or execute in the next runtime
+static void drain_tasks() {
+    while (tasks_in_flight.load(std::memory_order_acquire)) {
+        //only a worker may execute tasks, other threads share id with one
+        if (local_parking && thread_worker_handle_queued_task()) continue;
+        std::this_thread::yield();
     }
+}
 
+vine::runtime::~runtime() {
+    drain_pipeline();
+    drain_tasks();
     free_thread_pool();
+    restore_caller_affinity();
+
+    //creating thread stops being a worker
+    thread_id          = 0;
+    local_deque        = nullptr;
+    local_parking      = nullptr;
+    local_frame_arenas = nullptr;
+
+#ifdef VINE_PROFILER
+    vine::dump_profile(VINE_PROFILER_OUTPUT);
+#endif
+
+#ifdef VINE_STATS
+    vine::dump_stats(VINE_STATS_OUTPUT);
+#endif
+
+    runtime_alive = false;
+}
+
+void vine::runtime::run() {
+    apply_machine();
+    if (!current_machine) abort();  //no default machine provided
+
+    while (!should_shutdown) {
+        execute_current_machine();
+        apply_machine();
+    }
+
+    drain_pipeline();
+    should_shutdown = false;
+}
+
+void vine::runtime::run(const machine& m) {
+    set_machine(m);
+    run();
+}
+
+void vine::runtime::run_once(const machine& m) {
+    {
+        std::lock_guard<std::mutex> lock{state_mutex};
+        current_machine = &m;
+    }
+
+    execute_current_machine();
+    drain_pipeline();
+}
+
+void vine::run() {
+    runtime rt;
+    rt.run();
 }
+
+#ifndef VINE_NO_MAIN
+int main() {
+    vine::run();
+}
+#endif